@@ -0,0 +1,42 @@
+#include <limits.h>
+#include <stdint.h>
+#include "clock.h"
+
+__thread int64_t Clock_cached;
+
+int clock_timeout(int64_t t, int64_t now)
+{
+	if (t <= now)
+		return 0;
+	if (t - now >= (int64_t)INT_MAX * MSEC)
+		return INT_MAX;
+	return (t - now + MSEC - 1) / MSEC;
+}
+
+/* the wall clock's lead over the monotonic one, read between two readings
+ * of the latter, retried in case of being preempted in between */
+int64_t clock_real_offset()
+{
+	struct timespec r;
+	int64_t a, b, best = INT64_MAX, offset = 0;
+	unsigned i;
+	for (i = 0; i < 3 && best > USEC; i ++)
+	{
+		a = clock_now();
+		clock_gettime(CLOCK_REALTIME, &r);
+		b = clock_now();
+		if (b - a < best)
+		{
+			best = b - a;
+			offset = r.tv_sec * NSEC + r.tv_nsec - a - (b - a) / 2;
+		}
+	}
+	return offset;
+}
+
+void clock_to_real(int64_t t, struct timespec *ts)
+{
+	t += clock_real_offset();
+	ts->tv_sec = t / NSEC;
+	ts->tv_nsec = t % NSEC;
+}
@@ -0,0 +1,48 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* times are CLOCK_MONOTONIC ns, so unaffected by the wall clock being set,
+ * and converted to wall time only for logs */
+#define NSEC	1000000000LL
+#define MSEC	1000000LL /* ns per ms */
+#define USEC	1000LL /* ns per us */
+
+/* clock_gettime() is a vDSO call, no syscall */
+static inline int64_t clock_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * NSEC + t.tv_nsec;
+}
+
+/* the time as of the last clock_update() by this thread, to read it just
+ * once per loop iteration */
+extern __thread int64_t Clock_cached;
+
+static inline int64_t clock_update()
+{
+	return Clock_cached = clock_now();
+}
+
+static inline int64_t clock_cached()
+{
+	return Clock_cached;
+}
+
+/* poll() timeout until t, in ms rounded up */
+int clock_timeout(int64_t t, int64_t now);
+/* the wall clock's lead over the monotonic one, costing a few readings of
+ * each, so taken once for a batch of times to convert */
+int64_t clock_real_offset();
+/* a CLOCK_REALTIME time, such as the kernel's packet timestamps, taken
+ * recently enough that the wall clock is unlikely to have been set since */
+static inline int64_t clock_from_real(const struct timespec *ts, int64_t offset)
+{
+	return ts->tv_sec * NSEC + ts->tv_nsec - offset;
+}
+void clock_to_real(int64_t, struct timespec *);
+
+#endif
@@ -0,0 +1,118 @@
+/* compares echo checksums against the original 16-bit loop, which every
+ * send and receive used to run over the whole packet */
+#include <stdio.h>
+#include "ping.c"
+
+#define ROUNDS (1 << 20)
+
+static uint16_t old_checksum(struct icmp *i, size_t len)
+{
+	uint32_t sum = 0;
+	uint16_t *p = (uint16_t *)i;
+	while (len >= 2)
+	{
+		sum += *(p++);
+		len -= 2;
+	}
+	if (len)
+	{
+		uint16_t x = 0;
+		*(char *)&x = *(char *)p;
+		sum += x;
+	}
+
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+static struct icmp_packet Packet;
+static volatile uint16_t Sink;
+
+static double per_round(int64_t start)
+{
+	return (double)(clock_now() - start) / ROUNDS;
+}
+
+static int bench(uint16_t size)
+{
+	struct icmp *c = &Packet.icmp;
+	size_t len = size - sizeof(struct ip);
+	uint16_t x = 0;
+	unsigned n;
+	int64_t t;
+	double old_send, new_send, old_recv, new_recv;
+
+	memset(&Packet, 0, sizeof(Packet));
+	c->icmp_type = ICMP_ECHO;
+	t = clock_now();
+	for (n = 0; n < ROUNDS; n ++)
+	{
+		c->icmp_id = c->icmp_seq = n;
+		c->icmp_cksum = 0;
+		x += old_checksum(c, len);
+	}
+	old_send = per_round(t);
+	Sink = x;
+	t = clock_now();
+	for (n = 0; n < ROUNDS; n ++)
+		x += csum_update(csum_update(ECHO_CKSUM, 0, n), 0, n);
+	new_send = per_round(t);
+	Sink = x;
+
+	/* replies carry whatever the payload is, so verify a random one */
+	for (n = ICMP_MINLEN; n < len; n ++)
+		((unsigned char *)c)[n] = rand();
+	c->icmp_type = ICMP_ECHOREPLY;
+	c->icmp_cksum = 0;
+	c->icmp_cksum = old_checksum(c, len);
+	t = clock_now();
+	for (n = 0; n < ROUNDS; n ++)
+	{
+		/* reread each time, without the store forwarding stall of changing it */
+		__asm__ volatile("" ::: "memory");
+		x += old_checksum(c, len);
+	}
+	old_recv = per_round(t);
+	Sink = x;
+	t = clock_now();
+	for (n = 0; n < ROUNDS; n ++)
+	{
+		__asm__ volatile("" ::: "memory");
+		x += icmp_checksum(c, len);
+	}
+	new_recv = per_round(t);
+	Sink = x;
+
+	printf("%4u bytes: send %7.2f -> %5.2f ns, verify %7.2f -> %6.2f ns\n",
+			size, old_send, new_send, old_recv, new_recv);
+
+	/* and check they agree, on every id and seq of a zero payload */
+	memset(&Packet, 0, sizeof(Packet));
+	c->icmp_type = ICMP_ECHO;
+	for (n = 0; n < 1 << 16; n ++)
+	{
+		c->icmp_id = n;
+		c->icmp_seq = ~n;
+		c->icmp_cksum = 0;
+		if (old_checksum(c, len) != csum_update(csum_update(ECHO_CKSUM, 0, n), 0, ~n))
+		{
+			fprintf(stderr, "%u bytes: send checksum differs for id %u\n", size, n);
+			return -1;
+		}
+		c->icmp_cksum = old_checksum(c, len);
+		if (icmp_checksum(c, len))
+		{
+			fprintf(stderr, "%u bytes: packet fails verification for id %u\n", size, n);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	if (bench(PING_MIN_SIZE) < 0 || bench(PING_MAX_SIZE) < 0)
+		return 1;
+	return 0;
+}
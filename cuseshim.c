@@ -0,0 +1,51 @@
+/* preloaded into pingdev by pingdevbench, which plays the kernel's side of
+ * CUSE: opening /dev/cuse connects to the unix socket at $CUSE_SOCK, where
+ * each packet is a request or reply as on the device */
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* room for a burst of replies to many readers */
+#define BUFSIZE (64 << 20)
+
+int open(const char *path, int flags, ...)
+{
+	static int (*real_open)(const char *, int, ...);
+	struct sockaddr_un sa = { AF_UNIX };
+	const char *sock = getenv("CUSE_SOCK");
+	mode_t mode = 0;
+	int fd, size = BUFSIZE;
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+	if (!sock || strcmp(path, "/dev/cuse") || strlen(sock) >= sizeof(sa.sun_path))
+	{
+		if (!real_open)
+			real_open = dlsym(RTLD_NEXT, "open");
+		return real_open(path, flags, mode);
+	}
+	strcpy(sa.sun_path, sock);
+	if ((fd = socket(PF_UNIX, SOCK_SEQPACKET | (flags & O_CLOEXEC ? SOCK_CLOEXEC : 0), 0)) < 0)
+		return -1;
+	if (connect(fd, &sa, SUN_LEN(&sa)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (flags & O_NONBLOCK)
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
@@ -0,0 +1,245 @@
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "libpinger.h"
+#include "timer.h"
+
+/* tags are a slot index and a generation, so late results for a slot since
+ * reused are ignored */
+#define TAG_BITS	20
+#define TAG_SLOTS	(1U << TAG_BITS)
+
+struct request {
+	struct pinger_client *c;
+	uint32_t tag; /* 0 while free */
+	in_addr_t host;
+	int err; /* of sending, answered on expiry */
+	pinger_fn *fn;
+	void *arg;
+	struct timer timer;
+	unsigned next_free;
+};
+
+struct pinger_client {
+	int fd;
+	struct request **req;
+	unsigned size, used;
+	unsigned free; /* slot + 1, 0 if none */
+	uint32_t gen;
+	struct timers timers;
+	struct pinger_batch out;
+	struct pinger_batch in;
+};
+
+struct pinger_client *pinger_open(const char *path)
+{
+	struct pinger_client *c;
+	struct sockaddr_un la = { AF_UNIX }, sa = { AF_UNIX, PINGER_SOCKET };
+	if (path)
+	{
+		if (strlen(path) >= sizeof(sa.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		strcpy(sa.sun_path, path);
+	}
+	if (!(c = calloc(1, sizeof(*c))))
+		return NULL;
+	c->out.h = (struct pinger_hdr){ PINGER_MAGIC, PINGER_VERSION, PINGER_REQUEST };
+	/* results are only sent to bound clients, so autobind */
+	if ((c->fd = socket(PF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+			|| bind(c->fd, &la, sizeof(sa_family_t)) < 0
+			|| connect(c->fd, &sa, SUN_LEN(&sa)) < 0)
+	{
+		int err = errno;
+		if (c->fd >= 0)
+			close(c->fd);
+		free(c);
+		errno = err;
+		return NULL;
+	}
+	return c;
+}
+
+int pinger_fd(const struct pinger_client *c)
+{
+	return c->fd;
+}
+
+unsigned pinger_pending(const struct pinger_client *c)
+{
+	return c->used;
+}
+
+static void request_free(struct request *r)
+{
+	struct pinger_client *c = r->c;
+	if (r->timer.idx)
+		timer_del(&c->timers, &r->timer);
+	r->next_free = c->free;
+	c->free = (r->tag & (TAG_SLOTS - 1)) + 1;
+	r->tag = 0;
+	c->used --;
+}
+
+/* the slot is free again before the callback, which may submit more */
+static void request_done(struct request *r, int32_t time, uint32_t age)
+{
+	struct pinger_result res = { r->host, time, age };
+	request_free(r);
+	r->fn(r->arg, &res);
+}
+
+static void request_expire(struct timer *t)
+{
+	struct request *r = (struct request *)((char *)t - offsetof(struct request, timer));
+	request_done(r, r->err ? -r->err : -ETIMEDOUT, 0);
+}
+
+static struct request *request_alloc(struct pinger_client *c)
+{
+	struct request *r;
+	unsigned i;
+	if (c->free)
+	{
+		i = c->free - 1;
+		r = c->req[i];
+		c->free = r->next_free;
+	}
+	else
+	{
+		if (c->size == TAG_SLOTS)
+		{
+			errno = ENOBUFS;
+			return NULL;
+		}
+		if (c->size % 64 == 0)
+		{
+			struct request **n = realloc(c->req, (c->size + 64) * sizeof(*c->req));
+			if (!n)
+				return NULL;
+			c->req = n;
+		}
+		if (!(r = calloc(1, sizeof(*r))))
+			return NULL;
+		r->c = c;
+		i = c->size;
+		c->req[c->size++] = r;
+	}
+	if (!(++c->gen & ((1U << (32 - TAG_BITS)) - 1)))
+		c->gen ++;
+	r->tag = c->gen << TAG_BITS | i;
+	c->used ++;
+	return r;
+}
+
+static struct request *request_find(struct pinger_client *c, uint32_t tag)
+{
+	struct request *r;
+	if ((tag & (TAG_SLOTS - 1)) >= c->size)
+		return NULL;
+	r = c->req[tag & (TAG_SLOTS - 1)];
+	return r->tag == tag ? r : NULL;
+}
+
+int pinger_flush(struct pinger_client *c)
+{
+	unsigned i;
+	int64_t now;
+	if (!c->out.h.count)
+		return 0;
+	if (send(c->fd, &c->out, sizeof(c->out.h) + c->out.h.count * sizeof(c->out.t[0]), 0) < 0)
+	{
+		int err = errno;
+		if (err == EAGAIN || err == EWOULDBLOCK)
+			return -1;
+		/* answered from pinger_process() like any other */
+		now = clock_now();
+		for (i = 0; i < c->out.h.count; i ++)
+		{
+			struct request *r = request_find(c, c->out.t[i].tag);
+			if (!r)
+				continue;
+			r->err = err;
+			r->timer.expire = now;
+			if (timer_add(&c->timers, &r->timer) < 0)
+				return -1;
+		}
+		c->out.h.count = 0;
+		errno = err;
+		return -1;
+	}
+	c->out.h.count = 0;
+	return 0;
+}
+
+int pinger_submit(struct pinger_client *c, in_addr_t host, int32_t timeout, uint32_t max_age, pinger_fn *fn, void *arg)
+{
+	struct request *r;
+	uint32_t wait = (uint32_t)timeout > MAX_PING_TIMEOUT ? 0 : timeout;
+	if (c->out.h.count == PINGER_BATCH_MAX && pinger_flush(c) < 0 && c->out.h.count)
+		return -1;
+	if (!(r = request_alloc(c)))
+		return -1;
+	r->host = host;
+	r->err = 0;
+	r->fn = fn;
+	r->arg = arg;
+	r->timer.fn = &request_expire;
+	r->timer.expire = clock_now() + (wait + PINGER_CLIENT_SLACK) * USEC;
+	if (timer_add(&c->timers, &r->timer) < 0)
+	{
+		request_free(r);
+		return -1;
+	}
+	c->out.t[c->out.h.count++] = (struct pinger_target){ r->tag, host, timeout, max_age };
+	return 0;
+}
+
+int pinger_process(struct pinger_client *c)
+{
+	ssize_t len;
+	unsigned i;
+	int n = 0;
+	while ((len = recv(c->fd, &c->in, sizeof(c->in), 0)) >= 0)
+	{
+		if (len < (ssize_t)sizeof(c->in.h) || c->in.h.magic != PINGER_MAGIC
+				|| c->in.h.version != PINGER_VERSION || c->in.h.type != PINGER_RESULT
+				|| len != (ssize_t)(sizeof(c->in.h) + c->in.h.count * sizeof(c->in.t[0])))
+			continue;
+		for (i = 0; i < c->in.h.count; i ++)
+		{
+			struct request *r = request_find(c, c->in.t[i].tag);
+			if (!r)
+				continue;
+			request_done(r, c->in.t[i].time, c->in.t[i].age);
+			n ++;
+		}
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	return n + timer_run(&c->timers, clock_now());
+}
+
+int pinger_timeout(const struct pinger_client *c)
+{
+	return timer_timeout(&c->timers, clock_now());
+}
+
+void pinger_close(struct pinger_client *c)
+{
+	unsigned i;
+	for (i = 0; i < c->size; i ++)
+		if (c->req[i]->tag)
+			request_done(c->req[i], -ECANCELED, 0);
+	for (i = 0; i < c->size; i ++)
+		free(c->req[i]);
+	free(c->req);
+	free(c->timers.heap);
+	close(c->fd);
+	free(c);
+}
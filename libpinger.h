@@ -0,0 +1,44 @@
+#ifndef LIBPINGER_H
+#define LIBPINGER_H
+
+#include "pinger.h"
+
+/* asynchronous client of pingerd, for use from an event loop.  Requests are
+ * sent in batches, when one fills or on pinger_flush(), and each is answered
+ * exactly once through its callback from pinger_process(): by pingerd, or
+ * with -ETIMEDOUT if pingerd hasn't answered PINGER_CLIENT_SLACK after the
+ * request's own timeout.  Not thread-safe. */
+#define PINGER_CLIENT_SLACK	1000000 /* us */
+
+struct pinger_client;
+
+struct pinger_result {
+	in_addr_t host;
+	int32_t time; /* us, -errno */
+	uint32_t age; /* us, of a cached result */
+};
+
+typedef void pinger_fn(void *arg, const struct pinger_result *);
+
+/* connects to pingerd at path, or PINGER_SOCKET if NULL */
+struct pinger_client *pinger_open(const char *path);
+/* answers any requests outstanding with -ECANCELED */
+void pinger_close(struct pinger_client *);
+/* nonblocking, to be polled for POLLIN, and POLLOUT while pinger_flush()
+ * fails with EAGAIN */
+int pinger_fd(const struct pinger_client *);
+/* timeout in us, max_age as in struct pinger_target; fails with EAGAIN when
+ * a full batch can't be sent yet */
+int pinger_submit(struct pinger_client *, in_addr_t host, int32_t timeout, uint32_t max_age, pinger_fn *fn, void *arg);
+/* sends the requests batched so far; fails with EAGAIN while the socket is
+ * full, otherwise the batch is answered with the error */
+int pinger_flush(struct pinger_client *);
+/* answers the results received and the requests timed out, without
+ * blocking; returns how many, or -1 */
+int pinger_process(struct pinger_client *);
+/* poll timeout in ms until pinger_process() has requests to time out, or -1 */
+int pinger_timeout(const struct pinger_client *);
+/* requests submitted and not yet answered */
+unsigned pinger_pending(const struct pinger_client *);
+
+#endif
@@ -0,0 +1,111 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "lpm.h"
+
+static inline uint32_t mask(unsigned len)
+{
+	return len ? ~0U << (32 - len) : 0;
+}
+
+static inline unsigned bit(uint32_t x, unsigned i)
+{
+	return x >> (31 - i) & 1;
+}
+
+static int node_new(struct lpm *t, uint32_t prefix, unsigned len)
+{
+	if (t->count == t->size)
+	{
+		unsigned size = t->size ? 2*t->size : 64;
+		struct lpm_node *n = realloc(t->node, size * sizeof(*n));
+		if (!n)
+			return -1;
+		t->node = n;
+		t->size = size;
+	}
+	t->node[t->count] = (struct lpm_node){ prefix & mask(len), len };
+	return t->count++;
+}
+
+int lpm_add(struct lpm *t, in_addr_t net, unsigned len)
+{
+	uint32_t x = ntohl(net) & mask(len);
+	unsigned i = 0, b;
+	int c, s;
+
+	if (len > 32)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (!t->count && node_new(t, 0, 0) < 0)
+		return -1;
+	while (1)
+	{
+		if (len == t->node[i].len)
+		{
+			t->prefixes += !t->node[i].term;
+			t->node[i].term = true;
+			return 0;
+		}
+		b = bit(x, t->node[i].len);
+		if (!(c = t->node[i].child[b]))
+		{
+			if ((c = node_new(t, x, len)) < 0)
+				return -1;
+			t->node[c].term = true;
+			t->node[i].child[b] = c;
+			t->prefixes ++;
+			return 0;
+		}
+		/* length of the prefix shared with the child */
+		unsigned m = t->node[c].len < len ? t->node[c].len : len;
+		uint32_t d = (x ^ t->node[c].prefix) & mask(m);
+		unsigned common = d ? __builtin_clz(d) : m;
+		if (common == t->node[c].len)
+		{
+			i = c;
+			continue;
+		}
+		/* split the edge to the child */
+		if ((s = node_new(t, x, common)) < 0)
+			return -1;
+		t->node[s].child[bit(t->node[c].prefix, common)] = c;
+		t->node[i].child[b] = s;
+		if (common == len)
+		{
+			t->node[s].term = true;
+			t->prefixes ++;
+			return 0;
+		}
+		i = s;
+	}
+}
+
+int lpm_match(const struct lpm *t, in_addr_t ip)
+{
+	uint32_t x = ntohl(ip);
+	unsigned i = 0;
+	int r = -1;
+
+	if (!t->count)
+		return -1;
+	while (1)
+	{
+		const struct lpm_node *n = &t->node[i];
+		if ((x ^ n->prefix) & mask(n->len))
+			break;
+		if (n->term)
+			r = n->len;
+		if (n->len == 32 || !(i = n->child[bit(x, n->len)]))
+			break;
+	}
+	return r;
+}
+
+void lpm_free(struct lpm *t)
+{
+	free(t->node);
+	*t = (struct lpm){};
+}
@@ -0,0 +1,29 @@
+#ifndef LPM_H
+#define LPM_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct lpm_node {
+	uint32_t prefix; /* host order */
+	uint8_t len;
+	bool term; /* prefix was added */
+	uint32_t child[2]; /* node index, 0 if none */
+};
+
+/* path-compressed binary (patricia) trie of IPv4 prefixes, with nodes kept
+ * in one array, node 0 the root */
+struct lpm {
+	struct lpm_node *node;
+	unsigned count, size;
+	unsigned prefixes;
+};
+
+/* net in network order; returns -1 with errno set on failure */
+int lpm_add(struct lpm *, in_addr_t net, unsigned len);
+/* length of the longest prefix containing ip, or -1 if none */
+int lpm_match(const struct lpm *, in_addr_t ip);
+void lpm_free(struct lpm *);
+
+#endif
@@ -2,9 +2,18 @@
 #include <netinet/ip_icmp.h>
 #include <netinet/ip.h>
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 #include "ping.h"
+#include "clock.h"
 
 static int parse_net(in_addr_t *n, const char **s)
 {
@@ -44,76 +53,409 @@ int parse_netmask(struct netmask *nm, const char *s)
 		return -1;
 	if (!r && nm->mask && (r = ntohl(nm->mask) >> 24) <= 32)
 		nm->mask = ~htonl((1U << (32 - r)) - 1);
+	/* only prefixes */
+	uint32_t m = ~ntohl(nm->mask);
+	if (m & (m + 1))
+		return -1;
 	nm->net &= nm->mask;
 	return 1;
 }
 
-int ping_open()
+static uint64_t Stamp_key[2];
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+/* SipHash-2-4 */
+static uint64_t siphash(const uint64_t *m, unsigned words)
+{
+	uint64_t v0 = Stamp_key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = Stamp_key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = Stamp_key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = Stamp_key[1] ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t)(8*words) << 56;
+	unsigned i;
+	for (i = 0; i < words; i ++)
+	{
+		v3 ^= m[i];
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m[i];
+	}
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t stamp_mac(const struct ping_stamp *s)
 {
-	int s;
-	if ((s = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0)
+	return siphash((const uint64_t *)s, offsetof(struct ping_stamp, mac)/sizeof(uint64_t));
+}
+
+int ping_open(int type)
+{
+	int s = -1;
+	/* unprivileged ping sockets, where allowed by net.ipv4.ping_group_range */
+	if (type != SOCK_RAW)
+		s = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+	if (s < 0 && type != SOCK_DGRAM)
+		s = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+	if (s < 0)
 		return -1;
+	if (!Stamp_key[0] && !Stamp_key[1] && getrandom(Stamp_key, sizeof(Stamp_key), 0) != sizeof(Stamp_key))
+	{
+		close(s);
+		return -1;
+	}
 	int opt = 1;
-	setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt));
+	setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+	/* report when packets actually leave, on the error queue */
+	opt = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &opt, sizeof(opt));
+	/* room for a burst of replies to a full batch */
+	opt = 4*PING_BATCH*PING_MAX_SIZE;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &opt, sizeof(opt)) < 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
 	return s;
 }
 
-static uint16_t icmp_checksum(struct icmp *i, size_t len)
+static int ping_type(int icmp)
 {
-	uint32_t sum = 0;
-	uint16_t *p = (uint16_t *)i;
-	while (len >= 2)
+	int type;
+	socklen_t len = sizeof(type);
+	if (getsockopt(icmp, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return -1;
+	return type;
+}
+
+int ping_bind(int icmp, uint16_t *id)
+{
+	int type = ping_type(icmp);
+	if (type != SOCK_DGRAM)
+		return type < 0 ? -1 : 0;
+
+	/* the kernel sets the echo id from the local "port" */
+	struct sockaddr_in a = { AF_INET, *id };
+	socklen_t len = sizeof(a);
+	if (bind(icmp, &a, sizeof(a)) < 0)
 	{
-		sum += *(p++);
-		len -= 2;
+		if (errno != EADDRINUSE)
+			return -1;
+		a.sin_port = 0;
+		if (bind(icmp, &a, sizeof(a)) < 0)
+			return -1;
+	}
+	if (getsockname(icmp, &a, &len) < 0)
+		return -1;
+	*id = a.sin_port;
+	return 1;
+}
+
+int ping_filter(int icmp, const uint16_t *ids, unsigned n)
+{
+	struct sock_filter code[3 + 1 + PING_FILTER_IDS + 2];
+	unsigned i, l = 0;
+	int type = ping_type(icmp);
+	if (type != SOCK_RAW)
+		/* ping sockets only ever see replies to their own id */
+		return type < 0 ? -1 : 0;
+	if (n > PING_FILTER_IDS)
+		n = 0;
+	const unsigned len = 3 + (n ? 1 + n : 0) + 2, drop = len-2, accept = len-1;
+
+	/* x = ip header length, then match the icmp type and id */
+	code[l++] = (struct sock_filter)BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0);
+	code[l++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_IND, 0);
+	code[l] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ICMP_ECHOREPLY, n ? 0 : accept-l-1, drop-l-1);
+	l++;
+	if (n)
+	{
+		code[l++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_H|BPF_IND, offsetof(struct icmp, icmp_id));
+		for (i = 0; i < n; i ++, l ++)
+			code[l] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohs(ids[i]), accept-l-1, 0);
+	}
+	code[l++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	code[l++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, ~0U);
+
+	struct sock_fprog prog = { len, code };
+	return setsockopt(icmp, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int ping_filter_range(int icmp, uint16_t lo, uint16_t hi)
+{
+	int type = ping_type(icmp);
+	if (type != SOCK_RAW)
+		return type < 0 ? -1 : 0;
+	struct sock_filter code[] =
+		{ BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0)
+		, BPF_STMT(BPF_LD|BPF_B|BPF_IND, 0)
+		, BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ICMP_ECHOREPLY, 0, 4)
+		, BPF_STMT(BPF_LD|BPF_H|BPF_IND, offsetof(struct icmp, icmp_id))
+		, BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, lo, 0, 2)
+		, BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, hi, 1, 0)
+		, BPF_STMT(BPF_RET|BPF_K, ~0U)
+		, BPF_STMT(BPF_RET|BPF_K, 0)
+		};
+	struct sock_fprog prog = { sizeof(code)/sizeof(*code), code };
+	return setsockopt(icmp, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/* one's complement sum, 32 bits at a time into a 64-bit accumulator;
+ * segments must start at even offsets */
+static uint64_t csum_add(uint64_t sum, const void *buf, size_t len)
+{
+	const char *p = buf;
+	uint64_t x;
+	while (len >= 8)
+	{
+		memcpy(&x, p, 8);
+		sum += (x & 0xFFFFFFFF) + (x >> 32);
+		p += 8;
+		len -= 8;
 	}
 	if (len)
 	{
-		uint16_t x = 0;
-		*(char *)&x = *(char *)p;
-		sum += x;
+		x = 0;
+		memcpy(&x, p, len);
+		sum += (x & 0xFFFFFFFF) + (x >> 32);
 	}
+	return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
 
+/* RFC 1624 incremental update of checksum ck when a word changes from old */
+static uint16_t csum_update(uint16_t ck, uint16_t old, uint16_t new)
+{
+	uint32_t sum = (uint16_t)~ck + (uint16_t)~old + new;
 	sum = (sum & 0xFFFF) + (sum >> 16);
 	sum = (sum & 0xFFFF) + (sum >> 16);
 	return ~sum;
 }
 
+static uint16_t icmp_checksum(struct icmp *i, size_t len)
+{
+	return ~csum_fold(csum_add(0, i, len));
+}
+
 struct icmp_packet {
 	struct ip ip;
 	struct icmp icmp;
 	char buf[PING_MAX_SIZE-sizeof(struct icmp)-sizeof(struct ip)];
 };
 
-int ping_send(int icmp, uint16_t id, uint16_t seq, uint16_t size, struct in_addr host)
+#define ICMP_MAX_SIZE (PING_MAX_SIZE-sizeof(struct ip))
+
+static __thread struct {
+	struct icmp icmp;
+	char buf[ICMP_MAX_SIZE-sizeof(struct icmp)];
+} Tx_packets[PING_BATCH];
+
+/* checksum of an echo request with id = seq = 0, which as the payload is
+ * zero is the same at any size */
+#define ECHO_CKSUM ((uint16_t)~htons(ICMP_ECHO << 8))
+
+static unsigned send_chunk(int icmp, struct ping_pkt *p, unsigned n)
 {
-	if (size < PING_MIN_SIZE)
-		size = PING_MIN_SIZE;
-	else if (size > PING_MAX_SIZE) {
-		errno = EMSGSIZE;
-		return -1;
+	struct sockaddr_in addr[PING_BATCH];
+	struct iovec io[PING_BATCH];
+	struct mmsghdr msg[PING_BATCH];
+	struct ping_pkt *pp[PING_BATCH];
+	unsigned i, m = 0, sent = 0;
+	struct ping_stamp stamp = { PING_STAMP_VERSION, 0, clock_now() };
+
+	for (i = 0; i < n; i ++)
+	{
+		uint16_t size = p[i].size;
+		if (!size)
+			size = PING_STAMP_SIZE;
+		else if (size < PING_MIN_SIZE)
+			size = PING_MIN_SIZE;
+		else if (size > PING_MAX_SIZE) {
+			p[i].err = EMSGSIZE;
+			continue;
+		}
+		p[i].err = 0;
+		size -= sizeof(struct ip);
+
+		struct icmp *c = &Tx_packets[m].icmp;
+		c->icmp_type = ICMP_ECHO;
+		c->icmp_id = p[i].id;
+		c->icmp_seq = p[i].seq;
+		c->icmp_cksum = csum_update(csum_update(ECHO_CKSUM, 0, c->icmp_id), 0, c->icmp_seq);
+		/* the payload is zero, so just add in the stamp */
+		char *payload = (char *)c + ICMP_MINLEN;
+		if (size >= ICMP_MINLEN + sizeof(stamp))
+		{
+			stamp.cookie = p[i].cookie;
+			stamp.mac = stamp_mac(&stamp);
+			memcpy(payload, &stamp, sizeof(stamp));
+			c->icmp_cksum = ~csum_fold(csum_add((uint16_t)~c->icmp_cksum, &stamp, sizeof(stamp)));
+		}
+		else
+			memset(payload, 0, sizeof(stamp));
+
+		addr[m] = (struct sockaddr_in){ AF_INET, 0, p[i].host };
+		io[m] = (struct iovec){ c, size };
+		msg[m].msg_hdr = (struct msghdr)
+			{ .msg_name = &addr[m]
+			, .msg_namelen = sizeof(addr[m])
+			, .msg_iov = &io[m]
+			, .msg_iovlen = 1
+			};
+		pp[m++] = &p[i];
 	}
-	struct icmp_packet p = { .icmp =
-		{ .icmp_type = ICMP_ECHO
-		, .icmp_id = id
-		, .icmp_seq = seq
+
+	i = 0;
+	while (i < m)
+	{
+		int r = sendmmsg(icmp, &msg[i], m-i, 0);
+		if (r < 0)
+		{
+			/* the failure belongs to the first unsent message */
+			pp[i++]->err = errno;
+			continue;
 		}
-	};
-	size -= sizeof(struct ip);
-	p.icmp.icmp_cksum = icmp_checksum(&p.icmp, size);
-	struct sockaddr_in a = { AF_INET, 0, host };
-	ssize_t r = sendto(icmp, &p.icmp, size, 0, &a, sizeof(a));
-	if (r < 0)
-		return -1;
-	if (r < size)
+		for (r += i; i < r; i ++)
+			if (msg[i].msg_len < io[i].iov_len)
+				pp[i]->err = ENOBUFS;
+			else
+				sent ++;
+	}
+	return sent;
+}
+
+int ping_send_batch(int icmp, struct ping_pkt *p, unsigned n)
+{
+	unsigned sent = 0;
+	while (n > PING_BATCH)
 	{
-		errno = ENOBUFS;
-		return -1;
+		sent += send_chunk(icmp, p, PING_BATCH);
+		p += PING_BATCH;
+		n -= PING_BATCH;
+	}
+	return sent + send_chunk(icmp, p, n);
+}
+
+int ping_send(int icmp, uint16_t id, uint16_t seq, uint16_t size, struct in_addr host)
+{
+	struct ping_pkt p = { id, seq, size, host };
+	if (ping_send_batch(icmp, &p, 1) == 1)
+		return 0;
+	errno = p.err;
+	return -1;
+}
+
+/* the kernel stamps packets by the wall clock, ahead of ours by offset */
+static int64_t parse_ts(struct msghdr *msg, int64_t offset)
+{
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type == SO_TIMESTAMPNS)
+		{
+			struct timespec t;
+			memcpy(&t, CMSG_DATA(cmsg), sizeof(t));
+			return clock_from_real(&t, offset);
+		}
+		if (cmsg->cmsg_type == SO_TIMESTAMPING)
+		{
+			struct scm_timestamping t;
+			memcpy(&t, CMSG_DATA(cmsg), sizeof(t));
+			/* software stamp, as hardware ones are on the nic's clock */
+			if (t.ts[0].tv_sec)
+				return clock_from_real(&t.ts[0], offset);
+		}
 	}
 	return 0;
 }
 
-int ping_recv(int icmp, uint16_t *id, uint16_t *seq, struct in_addr *host, struct timeval *ts)
+static bool parse_reply(void *buf, ssize_t r, struct msghdr *msg, int64_t offset, struct ping_pkt *out)
+{
+	struct icmp_packet *p = buf;
+	const struct sockaddr_in *sa = msg->msg_name;
+	/* raw sockets include the ip header, ping sockets start at the icmp
+	 * header, whose echo reply type can't be mistaken for an ip version */
+	unsigned hl = r && p->ip.ip_v == IPVERSION ? p->ip.ip_hl : 0;
+	if ((hl && r < sizeof(struct ip)) || (r -= hl << 2) < 8)
+		return false;
+	// struct icmp *i = &p->icmp;
+	struct icmp *i = (struct icmp *)((uint32_t *)p + hl);
+	if (i->icmp_type != ICMP_ECHOREPLY || icmp_checksum(i, r) || sa->sin_family != AF_INET)
+		return false;
+	out->id = i->icmp_id;
+	out->seq = i->icmp_seq;
+	out->size = r + (hl ? hl << 2 : sizeof(struct ip));
+	out->host = sa->sin_addr;
+	out->ts = parse_ts(msg, offset);
+	out->cookie = 0;
+	out->rtt = -1;
+	struct ping_stamp stamp;
+	if (r >= ICMP_MINLEN + sizeof(stamp))
+	{
+		memcpy(&stamp, (char *)i + ICMP_MINLEN, sizeof(stamp));
+		if (stamp.version == PING_STAMP_VERSION && stamp.mac == stamp_mac(&stamp))
+		{
+			out->cookie = stamp.cookie;
+			out->rtt = (out->ts ? out->ts : clock_now()) - stamp.sent;
+		}
+	}
+	return true;
+}
+
+/* transmit timestamps come back with the whole packet as sent, including
+ * the link layer header, so look for the ip header behind it */
+static bool parse_sent(void *buf, ssize_t r, struct msghdr *msg, int64_t offset, struct ping_pkt *out)
+{
+	const char *b = buf;
+	size_t off;
+	struct ip ip;
+	for (off = 0; off + sizeof(ip) + ICMP_MINLEN <= r; off ++)
+	{
+		memcpy(&ip, b+off, sizeof(ip));
+		if (ip.ip_v == IPVERSION && ip.ip_hl >= 5 && ip.ip_p == IPPROTO_ICMP
+				&& ntohs(ip.ip_len) == r-off && off + (ip.ip_hl << 2) + ICMP_MINLEN <= r
+				&& csum_fold(csum_add(0, b+off, ip.ip_hl << 2)) == 0xFFFF)
+			break;
+	}
+	if (off + sizeof(ip) + ICMP_MINLEN > r)
+		return false;
+	struct icmp i;
+	memcpy(&i, b + off + (ip.ip_hl << 2), ICMP_MINLEN);
+	if (i.icmp_type != ICMP_ECHO)
+		return false;
+	out->id = i.icmp_id;
+	out->seq = i.icmp_seq;
+	out->size = r - off;
+	out->host = ip.ip_dst;
+	out->cookie = 0;
+	out->rtt = -1;
+	return (out->ts = parse_ts(msg, offset)) != 0;
+}
+
+int ping_recv(int icmp, uint16_t *id, uint16_t *seq, struct in_addr *host, int64_t *ts)
 {
 	struct sockaddr_in sa;
 	struct icmp_packet p;
@@ -138,23 +480,65 @@ int ping_recv(int icmp, uint16_t *id, uint16_t *seq, struct in_addr *host, struc
 		errno = ECANCELED;
 		return -1;
 	}
-	if (r < sizeof(struct ip) || (r -= p.ip.ip_hl << 2) < 8)
+	struct ping_pkt out;
+	if (!parse_reply(&p, r, &msg, clock_real_offset(), &out))
 		return 0;
-	// struct icmp *i = &p.icmp;
-	struct icmp *i = (struct icmp *)((uint32_t *)&p + p.ip.ip_hl);
-	if (i->icmp_type != ICMP_ECHOREPLY || icmp_checksum(i, r) || sa.sin_family != AF_INET)
-		return 0;
-	*id = i->icmp_id;
-	*seq = i->icmp_seq;
-	*host = sa.sin_addr;
-	if (ts) {
-		struct cmsghdr *cmsg;
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
-			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMP)
-			{
-				memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
-				break;
-			}
-	}
+	*id = out.id;
+	*seq = out.seq;
+	*host = out.host;
+	if (ts && out.ts)
+		*ts = out.ts;
 	return 1;
 }
+
+#define PING_LINK_MAX 64
+static __thread struct {
+	struct icmp_packet p;
+	char link[PING_LINK_MAX];
+	struct sockaddr_in sa;
+	struct iovec io;
+	char ctl[CMSG_SPACE(sizeof(struct timespec))
+		+ CMSG_SPACE(sizeof(struct scm_timestamping))
+		+ CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+} Rx_packets[PING_BATCH];
+
+static int recv_batch(int icmp, struct ping_pkt *out, unsigned *n, int flags,
+		bool (*parse)(void *, ssize_t, struct msghdr *, int64_t, struct ping_pkt *))
+{
+	struct mmsghdr msg[PING_BATCH];
+	unsigned i, m = *n;
+	if (m > PING_BATCH)
+		m = PING_BATCH;
+	for (i = 0; i < m; i ++)
+	{
+		Rx_packets[i].io = (struct iovec){ &Rx_packets[i].p, sizeof(Rx_packets[i].p) + PING_LINK_MAX };
+		msg[i].msg_hdr = (struct msghdr)
+			{ .msg_name = &Rx_packets[i].sa
+			, .msg_namelen = sizeof(Rx_packets[i].sa)
+			, .msg_iov = &Rx_packets[i].io
+			, .msg_iovlen = 1
+			, .msg_control = Rx_packets[i].ctl
+			, .msg_controllen = sizeof(Rx_packets[i].ctl)
+			};
+	}
+	*n = 0;
+	int r = recvmmsg(icmp, msg, m, MSG_DONTWAIT | flags, NULL);
+	if (r < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	/* one offset for the batch, rather than a few clock readings per stamp */
+	int64_t offset = clock_real_offset();
+	for (i = 0; i < r; i ++)
+		if (parse(&Rx_packets[i].p, msg[i].msg_len, &msg[i].msg_hdr, offset, &out[*n]))
+			++ *n;
+	return r;
+}
+
+int ping_recv_batch(int icmp, struct ping_pkt *out, unsigned *n)
+{
+	return recv_batch(icmp, out, n, 0, parse_reply);
+}
+
+int ping_sent_batch(int icmp, struct ping_pkt *out, unsigned *n)
+{
+	return recv_batch(icmp, out, n, MSG_ERRQUEUE, parse_sent);
+}
@@ -2,10 +2,13 @@
 #define PING_H
 
 #include <netinet/in.h>
-#include <sys/time.h>
+#include <stdint.h>
 
 #define PING_MIN_SIZE 28
 #define PING_MAX_SIZE 1500
+#define PING_STAMP_SIZE (PING_MIN_SIZE + sizeof(struct ping_stamp))
+#define PING_BATCH 64
+#define PING_FILTER_IDS 64
 
 struct netmask {
 	in_addr_t net, mask;
@@ -13,8 +16,49 @@ struct netmask {
 
 int parse_netmask(struct netmask *, const char *);
 
-int ping_open();
+/* buffers are per thread, so each thread can use its own socket once the
+ * first ping_open() has returned */
+
+/* type is SOCK_DGRAM, SOCK_RAW, or 0 to prefer the former */
+int ping_open(int type);
+/* ping sockets can only send with, and only receive, a single id: bind to
+ * *id if possible, and return 1 with the id in use; 0 for raw sockets */
+int ping_bind(int icmp, uint16_t *id);
+/* only deliver echo replies, and only to the given ids if there are at most
+ * PING_FILTER_IDS; may be called again to replace the set */
+int ping_filter(int icmp, const uint16_t *ids, unsigned n);
+/* likewise, to ids from lo to hi in host order */
+int ping_filter_range(int icmp, uint16_t lo, uint16_t hi);
 int ping_send(int icmp, uint16_t id, uint16_t seq, uint16_t size, struct in_addr host);
-int ping_recv(int icmp, uint16_t *id, uint16_t *seq, struct in_addr *host, struct timeval *ts);
+/* payload header of pings of at least PING_STAMP_SIZE, authenticated with a
+ * per-process key so replies can be trusted without remembering requests */
+#define PING_STAMP_VERSION 1
+struct ping_stamp {
+	uint32_t version;
+	uint32_t pad;
+	uint64_t sent; /* CLOCK_MONOTONIC ns */
+	uint64_t cookie;
+	uint64_t mac;
+};
+
+struct ping_pkt {
+	uint16_t id, seq, size;
+	struct in_addr host;
+	int64_t ts; /* receive or transmit time, CLOCK_MONOTONIC ns, 0 if unknown */
+	uint64_t cookie; /* carried in the stamp */
+	int64_t rtt; /* ns, from a reply's stamp, or -1 if it had none */
+	int err; /* errno of this packet's send, 0 on success */
+};
+
+/* returns the number of packets sent, failures are reported in each err;
+ * a size of 0 sends the smallest stamped packet */
+int ping_send_batch(int icmp, struct ping_pkt *, unsigned n);
+int ping_recv(int icmp, uint16_t *id, uint16_t *seq, struct in_addr *host, int64_t *ts);
+/* reads up to *n pending datagrams without blocking, storing the *n replies
+ * found; returns the number of datagrams read */
+int ping_recv_batch(int icmp, struct ping_pkt *, unsigned *n);
+/* likewise reads the echo requests sent, with the time they left the host,
+ * which are queued as socket errors (POLLERR) */
+int ping_sent_batch(int icmp, struct ping_pkt *, unsigned *n);
 
 #endif
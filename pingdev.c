@@ -3,41 +3,123 @@
 #include <fcntl.h>
 #include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/fuse.h>
 #include "ping.h"
 #include "pingdev.h"
+#include "uring.h"
+#include "timer.h"
 
 static char Devname[256] = "ping"; 
 static unsigned short Interval = 60;
-static struct in_addr Target;
 static unsigned Count;
 static float Threshold = INFINITY;
+static unsigned History = 64;
+static uint16_t Ping_size = PING_STAMP_SIZE;
+/* of results, or of seconds of them if unit is nonzero */
+static struct {
+	unsigned long n;
+	unsigned unit;
+} Window_spec[PINGDEV_WINDOWS] = { { 10 }, { 5, 60 }, { 1, 3600 } };
+static unsigned Windows; /* specified, 0 for the defaults */
+static unsigned Window_size[PINGDEV_WINDOWS];
+#define WINDOW_MAX 65535
+static unsigned Samples_mask; /* of each host's latest results, for the windows */
 
 static int Cuse = -1;
+/* read by threads of their own, all sharing Cuse, leaving the main one to
+ * probes */
+static unsigned Threads;
+static int Wake_fd = -1; /* kicks a thread to wake readers */
 static int Ping = -1;
+/* with a read of Cuse and a poll of Ping kept posted, unless fd is -1 */
+static struct uring Ring = { .fd = -1 };
+static bool No_uring;
+enum { RING_CUSE, RING_PING };
+static bool Ring_ping; /* poll posted */
+static bool Ring_oneshot; /* if multishot polls aren't supported */
 
-static char Target_str[INET_ADDRSTRLEN];
 static uint16_t Ping_id;
-static unsigned Ping_seq;
-static bool Ping_wait;
-static struct timeval Ping_time;
-static float Ping_last = NAN;
-static unsigned Ping_down;
+
+#define SKETCH_SUB_BITS	3
+#define SKETCH_SUB	(1 << SKETCH_SUB_BITS)
+#define SKETCH_BUCKETS	((33 - SKETCH_SUB_BITS) * SKETCH_SUB)
+
+/* a window's aggregates, kept up as results enter and leave it */
+struct window {
+	unsigned count, lost;
+	double mean, m2; /* Welford's, of the replies */
+	float ewma;
+	uint16_t *sketch; /* log-linear histogram of the replies in us */
+};
+
+/* a target's latest result */
+struct result {
+	unsigned seq;
+	bool wait;
+	int64_t time; /* of the last sent */
+	float last;
+	int text_len;
+	char text[32]; /* last as read, formatted once for all readers */
+};
+
+/* the hosts monitored, sorted by address, all pinged through Ping and
+ * scheduled by Timers, spread over the interval */
+static struct target {
+	struct in_addr host;
+	char str[INET_ADDRSTRLEN];
+	/* written by the probe thread under gen, a seqlock, for the threads
+	 * serving readers, as are hist, the windows and jitter */
+	unsigned gen;
+	struct result res;
+	unsigned down;
+	struct timer timer; /* of the next to send */
+	/* waiting, in the order they started to, so those a result wakes
+	 * come first; lock is of them and of all readers on the target */
+	pthread_mutex_t lock;
+	struct reader *readers, **readers_tail;
+	struct target *wake; /* queued in Wake */
+	bool waking;
+	struct pingdev_record *hist; /* seq % History */
+	struct window win[PINGDEV_WINDOWS];
+	float *samples; /* seq & Samples_mask */
+	float jitter, prev;
+} *Targets;
+static unsigned Targets_count;
+static struct target *Target_default; /* for new readers: the first given */
+static struct in_addr Target_first;
+static struct timers Timers;
+static struct ping_pkt Send[PING_BATCH];
+static unsigned Send_count;
+/* targets with readers woken by a result, served up to WAKE_BATCH at a
+ * time between sending probes, or by the threads */
+static struct target *Wake, **Wake_tail = &Wake;
+static pthread_mutex_t Wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool Wake_kick;
+#define WAKE_BATCH 256
 
 #define BUFSIZE 256
-static struct reader {
+#define READ_MAX (PINGDEV_HISTORY_MAX * sizeof(struct pingdev_record))
+struct reader {
+	struct target *t;
 	unsigned seq;
 	unsigned off;
 	float cur;
+	bool binary;
 	/* active only: */
 	struct reader *next, **prev;
 	/* read: */
@@ -45,7 +127,7 @@ static struct reader {
 	unsigned size;
 	/* poll: */
 	uint64_t kh;
-} *Readers;
+};
 
 static void stop(int sig) __attribute__((noreturn));
 static void stop(int sig) 
@@ -67,57 +149,147 @@ static void die(const char *msg, ...)
 	stop(0);
 }
 
+/* readers only wait for their target's next result, so join the end */
 static inline void reader_add(struct reader *r)
 {
-	struct reader **p = &Readers;
-
-	while (*p && (*p)->seq < r->seq)
-		p = &(*p)->next;
-
-	if ((r->next = *p))
-		r->next->prev = &r->next;
-	r->prev = p;
-	*p = r;
+	struct target *t = r->t;
+	r->next = NULL;
+	r->prev = t->readers_tail;
+	*t->readers_tail = r;
+	t->readers_tail = &r->next;
 }
 
 static inline void reader_del(struct reader *r)
 {
 	if ((*r->prev = r->next))
 		r->next->prev = r->prev;
+	else
+		r->t->readers_tail = r->prev;
 	r->next = NULL;
 	r->prev = NULL;
 }
 
-static inline float timeval_diff(const struct timeval *a, const struct timeval *b)
+static inline float secs(int64_t ns)
 {
-	/* assumes no wrap-around, which should be safe with timeouts limited */
-	return (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec)/1e6;
+	return (double)ns / NSEC;
 }
 
-static size_t cuse_read(struct fuse_in_header *in, size_t len)
+static int target_cmp(const void *a, const void *b)
+{
+	in_addr_t x = ((const struct target *)a)->host.s_addr;
+	in_addr_t y = ((const struct target *)b)->host.s_addr;
+	return x < y ? -1 : x > y;
+}
+
+static struct target *target_find(struct in_addr host)
+{
+	struct target key = { .host = host };
+	return bsearch(&key, Targets, Targets_count, sizeof(*Targets), &target_cmp);
+}
+
+/* the probe thread's side of a target's seqlock */
+static inline void target_write(struct target *t)
+{
+	__atomic_store_n(&t->gen, t->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void target_written(struct target *t)
+{
+	__atomic_store_n(&t->gen, t->gen + 1, __ATOMIC_RELEASE);
+}
+
+/* readers copy what they need after target_read() until target_reread()
+ * finds it wasn't written meanwhile */
+static inline unsigned target_read(const struct target *t)
+{
+	unsigned g;
+	/* the writer may have been preempted */
+	while ((g = __atomic_load_n(&t->gen, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return g;
+}
+
+static inline bool target_reread(const struct target *t, unsigned g)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&t->gen, __ATOMIC_RELAXED) != g;
+}
+
+static struct result target_result(const struct target *t)
+{
+	struct result res;
+	unsigned g;
+	do {
+		g = target_read(t);
+		res = t->res;
+	} while (target_reread(t, g));
+	return res;
+}
+
+static __thread union {
+	struct fuse_in_header in;
+	char buf[FUSE_MIN_READ_BUFFER];
+} Cuse_buf;
+
+/* the r bytes read into Cuse_buf */
+static size_t cuse_msg(struct fuse_in_header *in, size_t len, ssize_t r)
 {
-	static union {
-		struct fuse_in_header in;
-		char buf[FUSE_MIN_READ_BUFFER];
-	} buf;
-	ssize_t r = read(Cuse, buf.buf, sizeof(buf));
 	if (r < 0)
 		die("cuse read: %m\n");
-	if (r < sizeof(*in) || r != buf.in.len || r-sizeof(*in) > len)
-		die("cuse read: invalid message (%zd/%u/%zu)\n", r, buf.in.len, len);
-	memcpy(in, buf.buf, r);
+	if (r < sizeof(*in) || r != Cuse_buf.in.len || r-sizeof(*in) > len)
+		die("cuse read: invalid message (%zd/%u/%zu)\n", r, Cuse_buf.in.len, len);
+	memcpy(in, Cuse_buf.buf, r);
 	return r - sizeof(*in);
 }
 
+static size_t cuse_read(struct fuse_in_header *in, size_t len)
+{
+	return cuse_msg(in, len, read(Cuse, Cuse_buf.buf, sizeof(Cuse_buf)));
+}
+
+/* ENOENT means the request has been aborted, its caller killed */
 static void cuse_write(struct fuse_out_header *out)
 {
 	ssize_t r = write(Cuse, out, out->len);
+	if (r < 0 && errno == ENOENT)
+		return;
 	if (r < 0)
 		die("cuse write: %m\n");
 	if (r != out->len)
 		die("cuse write: short (%zd/%u)\n", r, out->len);
 }
 
+/* replies made while a target is locked, written once it isn't */
+#define OUT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+/* the most one reader adds: a poll notify and a read */
+#define OUT_MAX (OUT_ALIGN(sizeof(struct fuse_out_header) + sizeof(struct fuse_notify_poll_wakeup_out)) \
+		+ sizeof(struct fuse_out_header) + READ_MAX)
+static __thread struct {
+	size_t len;
+	char buf[16 * OUT_MAX] __attribute__((aligned(8)));
+} Out;
+
+static void out_add(uint64_t unique, int error, const void *buf, size_t len)
+{
+	struct fuse_out_header *h = (struct fuse_out_header *)(Out.buf + Out.len);
+	*h = (struct fuse_out_header){ .len = sizeof(*h) + len, .error = error, .unique = unique };
+	memcpy(h + 1, buf, len);
+	Out.len += OUT_ALIGN(h->len);
+}
+
+static void out_flush()
+{
+	size_t off = 0;
+	while (off < Out.len)
+	{
+		struct fuse_out_header *h = (struct fuse_out_header *)(Out.buf + off);
+		cuse_write(h);
+		off += OUT_ALIGN(h->len);
+	}
+	Out.len = 0;
+}
+
 static void cuse_init()
 {
 	size_t l = strnlen(Devname, 255)+1;
@@ -125,7 +297,7 @@ static void cuse_init()
 	if (l > 255)
 		die("cuse: devname too long\n");
 
-	if ((Cuse = open("/dev/cuse", O_RDWR)) < 0)
+	if ((Cuse = open("/dev/cuse", O_RDWR | O_CLOEXEC)) < 0)
 		die("/dev/cuse: %m\n");
 
 	struct {
@@ -144,7 +316,7 @@ static void cuse_init()
 	} out = {
 		{ .len = sizeof(out)-sizeof(out.devname)+l+1, .unique = in.h.unique },
 		{ .major = FUSE_KERNEL_VERSION, .minor = FUSE_KERNEL_MINOR_VERSION
-		, .max_read = BUFSIZE, .max_write = BUFSIZE
+		, .max_read = READ_MAX, .max_write = BUFSIZE
 		, .dev_major = 0, .dev_minor = 0
 		},
 		"DEVNAME="
@@ -170,6 +342,9 @@ static int pingdev_open(const struct fuse_in_header *h, const struct fuse_open_i
 	}
 
 	struct reader *r = calloc(sizeof(*r), 1);
+	if (!r)
+		return ENOMEM;
+	r->t = Target_default;
 	struct {
 		struct fuse_out_header h;
 		struct fuse_open_out o;
@@ -184,23 +359,168 @@ static int pingdev_open(const struct fuse_in_header *h, const struct fuse_open_i
 
 static inline bool poll_reader(struct reader *r)
 {
-	return r->off || r->seq != Ping_seq;
+	return r->off || r->seq != __atomic_load_n(&r->t->res.seq, __ATOMIC_ACQUIRE);
 }
 
-static float reader_value(const struct reader *r)
+static float reader_value(const struct reader *r, const struct result *res)
 {
-	float p = Ping_last;
-	if (r->seq != Ping_seq - 1 && Ping_wait)
+	float p = res->last;
+	if (r->seq != res->seq - 1 && res->wait)
 	{
-		struct timeval t;
-		gettimeofday(&t, NULL);
-		float dt = timeval_diff(&t, &Ping_time);
+		float dt = secs(clock_now() - res->time);
 		if (dt > p)
 			p = dt;
 	}
 	return p;
 }
 
+static unsigned sketch_bucket(float t)
+{
+	double us = t * 1e6;
+	uint32_t v = us < UINT32_MAX ? us : UINT32_MAX;
+	if (v < SKETCH_SUB)
+		return v;
+	unsigned e = 31 - __builtin_clz(v);
+	return (e - SKETCH_SUB_BITS + 1) * SKETCH_SUB + (v >> (e - SKETCH_SUB_BITS)) - SKETCH_SUB;
+}
+
+/* the middle of bucket b, in seconds */
+static float sketch_value(unsigned b)
+{
+	if (b < 2 * SKETCH_SUB)
+		return b / 1e6;
+	unsigned e = b / SKETCH_SUB - 1;
+	return (((b % SKETCH_SUB + SKETCH_SUB) << e) + ((1U << e) - 1) / 2.0) / 1e6;
+}
+
+static void window_enter(struct window *w, unsigned size, float t)
+{
+	w->count ++;
+	if (isinf(t))
+	{
+		w->lost ++;
+		return;
+	}
+	unsigned n = w->count - w->lost;
+	double d = t - w->mean;
+	w->mean += d / n;
+	w->m2 += d * (t - w->mean);
+	w->ewma = isnan(w->ewma) ? t : w->ewma + (t - w->ewma) * 2 / (size + 1);
+	w->sketch[sketch_bucket(t)] ++;
+}
+
+static void window_leave(struct window *w, float t)
+{
+	w->count --;
+	if (isinf(t))
+	{
+		w->lost --;
+		return;
+	}
+	unsigned n = w->count - w->lost;
+	w->sketch[sketch_bucket(t)] --;
+	if (!n)
+	{
+		w->mean = w->m2 = 0;
+		return;
+	}
+	double d = t - w->mean;
+	w->mean -= d / n;
+	w->m2 -= d * (t - w->mean);
+	if (w->m2 < 0)
+		w->m2 = 0;
+}
+
+/* redone from the results themselves, once per window's worth, so the
+ * rounding of removals doesn't build up */
+static void window_sum(struct window *w, const float *samples, unsigned seq)
+{
+	unsigned i, n = 0;
+	double mean = 0, m2 = 0;
+	for (i = 0; i < w->count; i ++)
+	{
+		float t = samples[(seq - i) & Samples_mask];
+		if (isinf(t))
+			continue;
+		double d = t - mean;
+		mean += d / ++n;
+		m2 += d * (t - mean);
+	}
+	w->mean = mean;
+	w->m2 = m2;
+}
+
+static struct pingdev_window window_stats(const struct window *w, unsigned size)
+{
+	static const float q[] = { 0, 0.5, 0.9, 0.99, 1 };
+	unsigned n = w->count - w->lost;
+	unsigned b = 0, seen = 0, k;
+	float v[5];
+	if (!n)
+		return (struct pingdev_window){ size, w->count, w->lost, w->ewma, NAN, NAN, NAN, NAN, NAN, NAN, NAN };
+	for (k = 0; k < 5; k ++)
+	{
+		unsigned rank = q[k] * (n - 1);
+		/* bounded, as it may be read while written */
+		while (seen + w->sketch[b] <= rank && b < SKETCH_BUCKETS - 1)
+			seen += w->sketch[b++];
+		v[k] = sketch_value(b);
+	}
+	return (struct pingdev_window){ size, w->count, w->lost, w->ewma
+		, w->mean, n > 1 ? sqrt(w->m2 / (n - 1)) : 0
+		, v[0], v[1], v[2], v[3], v[4] };
+}
+
+/* copies up to max of t's records from seq on, or from the oldest kept if
+ * that's gone, returning the count; none for a seq yet to come */
+static unsigned target_history(const struct target *t, unsigned *seq, struct pingdev_record *out, unsigned max)
+{
+	unsigned cur = t->res.seq;
+	unsigned kept = cur < History ? cur : History;
+	unsigned n, i;
+	if ((int)(cur - *seq) < 0)
+		return 0;
+	if (cur - *seq > kept)
+		*seq = cur - kept;
+	n = cur - *seq;
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i ++)
+		out[i] = t->hist[(*seq + i) % History];
+	return n;
+}
+
+static void reader_records(struct reader *r)
+{
+	struct pingdev_record rec[PINGDEV_HISTORY_MAX];
+	unsigned max = r->size / sizeof(rec[0]), n = 0, seq, g;
+	int err = 0;
+	if (!max)
+		err = -EINVAL;
+	else
+	{
+		do {
+			g = target_read(r->t);
+			seq = r->seq;
+			n = target_history(r->t, &seq, rec, max);
+		} while (target_reread(r->t, g));
+		r->seq = seq + n;
+	}
+	out_add(r->unique, err, rec, n * sizeof(rec[0]));
+	r->size = 0;
+}
+
+/* as read, in ms */
+static int format_ping(float p, char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "%f\n", 1000*p);
+	if (len < 0)
+		die("snprintf: %m\n");
+	if (len >= size)
+		len = size - 1;
+	return len;
+}
+
 static bool handle_reader(struct reader *r)
 {
 	if (!poll_reader(r))
@@ -215,35 +535,41 @@ static bool handle_reader(struct reader *r)
 
 	if (r->kh)
 	{
-		struct {
-			struct fuse_out_header h;
-			struct fuse_notify_poll_wakeup_out n;
-		} out = {
-			{ .len = sizeof(out), .error = FUSE_NOTIFY_POLL },
-			{ .kh = r->kh }
-		};
-		cuse_write(&out.h);
+		struct fuse_notify_poll_wakeup_out n = { .kh = r->kh };
+		out_add(0, FUSE_NOTIFY_POLL, &n, sizeof(n));
 		r->kh = 0;
 	}
 
 	if (!r->size)
 		return true;
 
+	if (r->binary)
+	{
+		reader_records(r);
+		return true;
+	}
+
+	struct result res = target_result(r->t);
 	if (!r->off)
 	{
-		r->cur = reader_value(r);
-		r->seq = Ping_seq - 1;
+		r->cur = reader_value(r, &res);
+		r->seq = res.seq - 1;
 	}
 
-	static char buffer[BUFSIZE];
-	char *buf = buffer;
+	char buffer[BUFSIZE];
+	const char *buf;
 	int len;
 
-	len = snprintf(buf, BUFSIZE, "%f\n", 1000*r->cur);
-	if (len > BUFSIZE)
-		len = BUFSIZE;
-	if (len < 0)
-		die("snprintf: %m\n");
+	if (r->cur == res.last)
+	{
+		buf = res.text;
+		len = res.text_len;
+	}
+	else
+	{
+		buf = buffer;
+		len = format_ping(r->cur, buffer, sizeof(buffer));
+	}
 	buf += r->off;
 	len -= r->off;
 
@@ -258,30 +584,98 @@ static bool handle_reader(struct reader *r)
 		r->off = 0;
 	}
 
-	struct {
-		struct fuse_out_header h;
-		char buf[BUFSIZE];
-	} __attribute__((packed)) out = {
-		{ .len = sizeof(out.h) + len, .unique = r->unique }
-	};
-	memcpy(out.buf, buf, len);
-	cuse_write(&out.h);
+	out_add(r->unique, 0, buf, len);
 	r->size = 0;
 
 	return true;
 }
 
-static void handle_readers()
+/* queues t to wake the readers its new result has readied, without
+ * looking at them, as the probe thread doesn't */
+static void target_wake(struct target *t)
+{
+	pthread_mutex_lock(&Wake_lock);
+	if (!t->waking)
+	{
+		t->waking = true;
+		t->wake = NULL;
+		*Wake_tail = t;
+		Wake_tail = &t->wake;
+	}
+	pthread_mutex_unlock(&Wake_lock);
+}
+
+/* locks the target r is on, which PINGDEV_SET_TARGET may change meanwhile */
+static struct target *reader_lock(struct reader *r)
+{
+	struct target *t;
+	while (1)
+	{
+		t = __atomic_load_n(&r->t, __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&t->lock);
+		if (t == r->t)
+			return t;
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+/* serves up to max of t's woken readers, queueing it again if that leaves
+ * some, and returns how many */
+static unsigned target_serve(struct target *t, unsigned max)
 {
-	while (Readers && handle_reader(Readers));
+	unsigned n = 0;
+	bool more;
+	pthread_mutex_lock(&t->lock);
+	while ((more = t->readers && poll_reader(t->readers)) && n < max)
+	{
+		if (sizeof(Out.buf) - Out.len < OUT_MAX)
+		{
+			pthread_mutex_unlock(&t->lock);
+			out_flush();
+			pthread_mutex_lock(&t->lock);
+			continue;
+		}
+		handle_reader(t->readers);
+		n ++;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (more)
+		target_wake(t);
+	return n;
+}
+
+/* serves up to WAKE_BATCH woken readers, returning whether there are more */
+static bool wake_readers()
+{
+	unsigned n = 0;
+	bool more;
+	while (n < WAKE_BATCH)
+	{
+		pthread_mutex_lock(&Wake_lock);
+		struct target *t = Wake;
+		if (t)
+		{
+			if (!(Wake = t->wake))
+				Wake_tail = &Wake;
+			t->waking = false;
+		}
+		pthread_mutex_unlock(&Wake_lock);
+		if (!t)
+			break;
+		n += target_serve(t, WAKE_BATCH - n);
+	}
+	out_flush();
+	pthread_mutex_lock(&Wake_lock);
+	more = Wake;
+	pthread_mutex_unlock(&Wake_lock);
+	return more;
 }
 
 static void interrupt_reader(struct reader *r)
 {
 	if (r->size)
 	{
-		struct fuse_out_header out = { .len = sizeof(out), .error = -EINTR, .unique = r->unique };
-		cuse_write(&out);
+		out_add(r->unique, -EINTR, NULL, 0);
 		r->size = 0;
 	}
 }
@@ -295,10 +689,13 @@ static int pingdev_read(const struct fuse_in_header *h, const struct fuse_read_i
 		return 0;
 
 	struct reader *r = (struct reader *)in->fh;
+	struct target *t = reader_lock(r);
 	interrupt_reader(r);
 	r->unique = h->unique;
 	r->size = in->size;
 	handle_reader(r);
+	pthread_mutex_unlock(&t->lock);
+	out_flush();
 	return -1;
 }
 
@@ -307,17 +704,22 @@ static int pingdev_interrupt(const struct fuse_in_header *h, const struct fuse_i
 	if (len < sizeof(*in))
 		return EINVAL;
 
-	struct reader *r;
-	for (r = Readers; r; r = r->next)
+	/* rare enough to search every target for */
+	struct reader *r = NULL;
+	unsigned i;
+	for (i = 0; i < Targets_count && !r; i ++)
 	{
-		if (r->unique == in->unique)
+		struct target *t = &Targets[i];
+		pthread_mutex_lock(&t->lock);
+		for (r = t->readers; r && r->unique != in->unique; r = r->next);
+		if (r)
 		{
 			interrupt_reader(r);
 			reader_del(r);
-			break;
 		}
+		pthread_mutex_unlock(&t->lock);
 	}
-
+	out_flush();
 	return -1;
 }
 
@@ -327,8 +729,10 @@ static int pingdev_release(const struct fuse_in_header *h, const struct fuse_rel
 		return EINVAL;
 
 	struct reader *r = (struct reader *)in->fh;
+	struct target *t = reader_lock(r);
 	if (r->prev)
 		reader_del(r);
+	pthread_mutex_unlock(&t->lock);
 	free(r);
 	return 0;
 }
@@ -342,18 +746,21 @@ static int pingdev_ioctl(const struct fuse_in_header *h, const struct fuse_ioctl
 	switch (in->cmd)
 	{
 		case PINGDEV_GET_PING: {
+			struct target *t = reader_lock(r);
+			struct result res = target_result(t);
 			struct {
 				struct fuse_out_header h;
 				struct fuse_ioctl_out o;
 				float p;
 			} __attribute__((packed)) out = {
 				{ .len = sizeof(out), .unique = h->unique },
-				{ .result = (Ping_seq - 1) & INT_MAX },
-				reader_value(r)
+				{ .result = (res.seq - 1) & INT_MAX },
+				reader_value(r, &res)
 			};
-			cuse_write(&out.h);
 			if (!r->prev)
-				r->seq = Ping_seq;
+				r->seq = res.seq;
+			pthread_mutex_unlock(&t->lock);
+			cuse_write(&out.h);
 			return -1;
 	        }
 		case PINGDEV_GET_INTERVAL: {
@@ -375,8 +782,97 @@ static int pingdev_ioctl(const struct fuse_in_header *h, const struct fuse_ioctl
 			} out = {
 				{ .len = sizeof(out), .unique = h->unique },
 				{ },
-				Target
+				__atomic_load_n(&r->t, __ATOMIC_RELAXED)->host
+			};
+			cuse_write(&out.h);
+			return -1;
+		}
+		case PINGDEV_SET_TARGET: {
+			struct in_addr a;
+			struct target *t;
+			if (in->in_size < sizeof(a) || len < sizeof(*in) + sizeof(a))
+				return EINVAL;
+			memcpy(&a, in + 1, sizeof(a));
+			if (!(t = target_find(a)))
+				return ENOENT;
+			/* as if reopened on t */
+			struct target *old = reader_lock(r);
+			interrupt_reader(r);
+			if (r->prev)
+				reader_del(r);
+			r->seq = 0;
+			r->off = 0;
+			__atomic_store_n(&r->t, t, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&old->lock);
+			out_flush();
+			struct {
+				struct fuse_out_header h;
+				struct fuse_ioctl_out o;
+			} out = {
+				{ .len = sizeof(out), .unique = h->unique },
+				{ }
+			};
+			cuse_write(&out.h);
+			return -1;
+		}
+		case PINGDEV_SET_BINARY: {
+			struct target *t = reader_lock(r);
+			r->binary = in->arg != 0;
+			r->off = 0;
+			pthread_mutex_unlock(&t->lock);
+			struct {
+				struct fuse_out_header h;
+				struct fuse_ioctl_out o;
+			} out = {
+				{ .len = sizeof(out), .unique = h->unique },
+				{ }
+			};
+			cuse_write(&out.h);
+			return -1;
+		}
+		case PINGDEV_GET_STATS: {
+			struct {
+				struct fuse_out_header h;
+				struct fuse_ioctl_out o;
+				struct pingdev_stats s;
+			} out = {
+				{ .len = sizeof(out), .unique = h->unique }
+			};
+			const struct target *t = __atomic_load_n(&r->t, __ATOMIC_ACQUIRE);
+			unsigned i, g;
+			do {
+				g = target_read(t);
+				out.s.seq = t->res.seq;
+				out.s.jitter = t->jitter;
+				for (i = 0; i < Windows; i ++)
+					out.s.win[i] = window_stats(&t->win[i], Window_size[i]);
+			} while (target_reread(t, g));
+			cuse_write(&out.h);
+			return -1;
+		}
+		case PINGDEV_GET_HISTORY: {
+			struct {
+				struct fuse_out_header h;
+				struct fuse_ioctl_out o;
+				struct pingdev_history hist;
+			} out = {
+				{ .unique = h->unique }
 			};
+			if (in->in_size < sizeof(out.hist.seq) || len < sizeof(*in) + sizeof(out.hist.seq)
+					|| in->out_size < sizeof(out.hist))
+				return EINVAL;
+			memcpy(&out.hist.seq, in + 1, sizeof(out.hist.seq));
+			const struct target *t = __atomic_load_n(&r->t, __ATOMIC_ACQUIRE);
+			unsigned seq, g;
+			do {
+				g = target_read(t);
+				seq = out.hist.seq;
+				out.hist.count = target_history(t, &seq, out.hist.rec, PINGDEV_HISTORY_MAX);
+			} while (target_reread(t, g));
+			out.hist.seq = seq;
+			out.o.result = out.hist.count;
+			/* the records returned are all that's copied out */
+			out.h.len = offsetof(typeof(out), hist.rec) + out.hist.count * sizeof(out.hist.rec[0]);
 			cuse_write(&out.h);
 			return -1;
 		}
@@ -395,7 +891,15 @@ static int pingdev_poll(const struct fuse_in_header *h, const struct fuse_poll_i
 		return EINVAL;
 
 	struct reader *r = (struct reader *)in->fh;
+	struct target *t = reader_lock(r);
 	bool p = poll_reader(r);
+	if (!p && in->flags & FUSE_POLL_SCHEDULE_NOTIFY && in->kh)
+	{
+		r->kh = in->kh;
+		if (!r->prev)
+			reader_add(r);
+	}
+	pthread_mutex_unlock(&t->lock);
 
 	struct {
 		struct fuse_out_header h;
@@ -406,23 +910,17 @@ static int pingdev_poll(const struct fuse_in_header *h, const struct fuse_poll_i
 	};
 	cuse_write(&out.h);
 
-	if (!p && in->flags & FUSE_POLL_SCHEDULE_NOTIFY && in->kh)
-	{
-		r->kh = in->kh;
-		if (!r->prev)
-			reader_add(r);
-	}
-
 	return -1;
 }
 
-static void cuse_in()
+static void cuse_in(ssize_t n)
 {
+	/* large enough for PINGDEV_GET_HISTORY's */
 	struct {
 		struct fuse_in_header h;
-		char buf[1024];
+		char buf[sizeof(Cuse_buf) - sizeof(struct fuse_in_header)];
 	} in;
-	size_t r = cuse_read(&in.h, sizeof(in.buf));
+	size_t r = cuse_msg(&in.h, sizeof(in.buf), n);
 
 	int err;
 	switch (in.h.opcode)
@@ -458,8 +956,8 @@ static void cuse_in()
 	}
 }
 
-void log_down(bool up) {
-	unsigned t = Interval * Ping_down;
+void log_down(const struct target *tg, bool up) {
+	unsigned t = Interval * tg->down;
 	char u;
 	if (t < 60)
 		u = 's';
@@ -477,79 +975,368 @@ void log_down(bool up) {
 			}
 		}
 	}
-	syslog(up ? LOG_NOTICE : LOG_WARNING, "%s: %s %u%c", Target_str, up ? "up after" : "down for", t, u);
+	syslog(up ? LOG_NOTICE : LOG_WARNING, "%s: %s %u%c", tg->str, up ? "up after" : "down for", t, u);
 }
 
-static void ping_update(float t)
+static int64_t real_ns(int64_t t)
 {
-	Ping_last = t;
-	Ping_wait = false;
-	Ping_seq ++;
+	struct timespec ts;
+	clock_to_real(t, &ts);
+	return ts.tv_sec * NSEC + ts.tv_nsec;
+}
 
-	handle_readers();
+static void target_stats(struct target *tg, float t)
+{
+	unsigned i, seq = tg->res.seq;
+	for (i = 0; i < Windows; i ++)
+	{
+		if (tg->win[i].count == Window_size[i])
+			window_leave(&tg->win[i], tg->samples[(seq - Window_size[i]) & Samples_mask]);
+		window_enter(&tg->win[i], Window_size[i], t);
+	}
+	tg->samples[seq & Samples_mask] = t;
+	for (i = 0; i < Windows; i ++)
+		if ((seq + 1) % Window_size[i] == 0)
+			window_sum(&tg->win[i], tg->samples, seq);
+	if (!isinf(t) && !isinf(tg->prev))
+		tg->jitter += (fabsf(t - tg->prev) - tg->jitter) / 16;
+	tg->prev = t;
+}
+
+static void ping_update(struct target *tg, float t)
+{
+	target_write(tg);
+	tg->hist[tg->res.seq % History] = (struct pingdev_record){ tg->res.seq, t, real_ns(tg->res.time) };
+	target_stats(tg, t);
+	tg->res.last = t;
+	tg->res.text_len = format_ping(t, tg->res.text, sizeof(tg->res.text));
+	tg->res.wait = false;
+	__atomic_store_n(&tg->res.seq, tg->res.seq + 1, __ATOMIC_RELEASE);
+	target_written(tg);
+
+	target_wake(tg);
+	Wake_kick = true;
 
 	if (t >= Threshold) {
-		if (++Ping_down == Count)
-			log_down(false);
+		if (++tg->down == Count)
+			log_down(tg, false);
 	}
 	else if (Count) {
-		if (Ping_down >= Count)
-			log_down(true);
-		Ping_down = 0;
+		if (tg->down >= Count)
+			log_down(tg, true);
+		tg->down = 0;
 	}
 }
 
-static void ping_in()
+static void ping_reply(const struct ping_pkt *p)
 {
-	uint16_t id, seq;
-	struct in_addr host;
-	struct timeval t = {};
-	int r = ping_recv(Ping, &id, &seq, &host, &t);
-	if (r < 0)
-		die("ping recv: %m\n");
-	if (!r) 
+	struct target *tg;
+	if (p->id != Ping_id || !(tg = target_find(p->host)))
 		return;
-	if (id != Ping_id || host.s_addr != Target.s_addr)
+	int64_t t = p->ts ? p->ts : clock_now();
+	if (p->seq == (uint16_t)tg->res.seq && (!p->cookie || p->cookie == tg->res.seq) && tg->res.wait)
+	{
+		ping_update(tg, secs(t - tg->res.time));
+	}
+	else if (p->seq == (uint16_t)(tg->res.seq-1) && isinf(tg->res.last))
+	{
+		/* the stamp gives the exact time of a late reply */
+		target_write(tg);
+		if (p->cookie == tg->res.seq-1 && p->rtt >= 0)
+			tg->res.last = p->rtt/1e9;
+		else
+			tg->res.last = secs(t - tg->res.time) + Interval;
+		tg->res.text_len = format_ping(tg->res.last, tg->res.text, sizeof(tg->res.text));
+		tg->hist[(tg->res.seq-1) % History].ping = tg->res.last;
+		target_written(tg);
+	}
+}
+
+static void ping_in()
+{
+	struct ping_pkt replies[PING_BATCH];
+	unsigned i, n;
+	int r;
+	do {
+		n = PING_BATCH;
+		if ((r = ping_recv_batch(Ping, replies, &n)) < 0)
+			die("ping recv: %m\n");
+		for (i = 0; i < n; i ++)
+			ping_reply(&replies[i]);
+	} while (r == PING_BATCH);
+}
+
+static void ping_err()
+{
+	struct ping_pkt sent[PING_BATCH];
+	unsigned i, n;
+	int r;
+	do {
+		n = PING_BATCH;
+		if ((r = ping_sent_batch(Ping, sent, &n)) < 0)
+			die("ping sent: %m\n");
+		for (i = 0; i < n; i ++)
+		{
+			struct target *tg;
+			if (sent[i].id == Ping_id && (tg = target_find(sent[i].host))
+					&& sent[i].seq == (uint16_t)tg->res.seq && tg->res.wait && sent[i].ts)
+			{
+				target_write(tg);
+				tg->res.time = sent[i].ts;
+				target_written(tg);
+			}
+		}
+	} while (r == PING_BATCH);
+}
+
+static void send_flush()
+{
+	unsigned i;
+	if (!Send_count)
 		return;
-	if (!timerisset(&t))
-		gettimeofday(&t, NULL);
-	if (seq == (uint16_t)Ping_seq)
+	ping_send_batch(Ping, Send, Send_count);
+	/* a host that can't be sent to is just down */
+	for (i = 0; i < Send_count; i ++)
+		if (Send[i].err)
+			fprintf(stderr, "ping_send %s: %s\n", inet_ntoa(Send[i].host), strerror(Send[i].err));
+	Send_count = 0;
+}
+
+static void target_send(struct timer *timer)
+{
+	struct target *tg = (struct target *)((char *)timer - offsetof(struct target, timer));
+	int64_t now = clock_cached();
+	if (tg->res.wait)
+		ping_update(tg, INFINITY);
+
+	target_write(tg);
+	tg->res.time = now;
+	tg->res.wait = true;
+	target_written(tg);
+	if (Send_count == PING_BATCH)
+		send_flush();
+	Send[Send_count++] = (struct ping_pkt){ Ping_id, tg->res.seq, Ping_size, tg->host, .cookie = tg->res.seq };
+
+	/* keeping to the schedule, unless too far behind */
+	if ((tg->timer.expire += Interval * NSEC) <= now)
+		tg->timer.expire = now + Interval * NSEC;
+	if (timer_add(&Timers, &tg->timer) < 0)
+		die("timer_add: %m\n");
+}
+
+static void targets_init()
+{
+	unsigned i;
+	int64_t now = clock_update();
+	unsigned j, samples = 1;
+	if (!Windows)
+		Windows = PINGDEV_WINDOWS;
+	for (j = 0; j < Windows; j ++)
 	{
-		ping_update(timeval_diff(&t, &Ping_time));
+		unsigned long n = Window_spec[j].n;
+		if (Window_spec[j].unit)
+			n = (n * Window_spec[j].unit + Interval - 1) / Interval;
+		if (n > WINDOW_MAX)
+			die("window too long: %lu results\n", n);
+		Window_size[j] = n;
+		while (samples < n)
+			samples <<= 1;
 	}
-	else if (seq == (uint16_t)(Ping_seq-1) && isinf(Ping_last))
+	Samples_mask = samples - 1;
+	struct pingdev_record *hist = calloc((size_t)Targets_count * History, sizeof(*hist));
+	float *sample = calloc((size_t)Targets_count * samples, sizeof(*sample));
+	uint16_t *sketch = calloc((size_t)Targets_count * Windows * SKETCH_BUCKETS, sizeof(*sketch));
+	if (!hist || !sample || !sketch)
+		die("calloc: %m\n");
+	qsort(Targets, Targets_count, sizeof(*Targets), &target_cmp);
+	for (i = 0; i < Targets_count; i ++)
 	{
-		Ping_last = timeval_diff(&t, &Ping_time) + Interval;
+		struct target *tg = &Targets[i];
+		if (i && tg->host.s_addr == tg[-1].host.s_addr)
+			die("duplicate host: %s\n", inet_ntoa(tg->host));
+		inet_ntop(AF_INET, &tg->host, tg->str, sizeof(tg->str));
+		tg->res.last = NAN;
+		pthread_mutex_init(&tg->lock, NULL);
+		tg->readers_tail = &tg->readers;
+		tg->hist = hist + (size_t)i * History;
+		tg->samples = sample + (size_t)i * samples;
+		tg->prev = INFINITY;
+		for (j = 0; j < Windows; j ++)
+		{
+			tg->win[j].ewma = NAN;
+			tg->win[j].sketch = sketch + ((size_t)i * Windows + j) * SKETCH_BUCKETS;
+		}
+		tg->timer.fn = &target_send;
+		tg->timer.expire = now + (int64_t)Interval * NSEC * i / Targets_count;
+		if (timer_add(&Timers, &tg->timer) < 0)
+			die("timer_add: %m\n");
 	}
+	Target_default = target_find(Target_first);
 }
 
-static void loop()
+/* waits like poll() on Cuse and Ping, but reading Cuse through Ring and
+ * polling Ping with a multishot poll, from Linux 5.13, which stays armed
+ * while Ping is drained each time */
+static void ring_wait(int timeout)
 {
-	struct timeval now, diff;
-	gettimeofday(&now, NULL);
-	timersub(&now, &Ping_time, &diff);
-	if (diff.tv_sec >= Interval)
+	struct io_uring_cqe *cqe;
+	if (!Ring_ping)
 	{
-		if (Ping_wait)
-			ping_update(INFINITY);
+		if (uring_poll(&Ring, Ping, POLLIN|POLLERR, !Ring_oneshot, RING_PING) < 0)
+			die("io_uring poll: %m\n");
+		Ring_ping = true;
+	}
+	if (uring_wait(&Ring, timeout) < 0)
+	{
+		if (errno == EINTR)
+			return;
+		die("io_uring wait: %m\n");
+	}
+	while ((cqe = uring_peek(&Ring)))
+	{
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		uring_seen(&Ring);
+		if (data == RING_CUSE)
+		{
+			errno = -res;
+			cuse_in(res);
+			if (uring_read(&Ring, Cuse, Cuse_buf.buf, sizeof(Cuse_buf), RING_CUSE) < 0)
+				die("io_uring read: %m\n");
+			continue;
+		}
+		if (!(flags & IORING_CQE_F_MORE))
+			Ring_ping = false;
+		if (res == -EINVAL && !Ring_oneshot)
+		{
+			Ring_oneshot = true;
+			continue;
+		}
+		if (res < 0)
+		{
+			errno = -res;
+			die("io_uring poll: %m\n");
+		}
+		if (res & POLLERR)
+			ping_err();
+		if (res & POLLIN)
+			ping_in();
+	}
+}
+
+/* falling back to poll() if it can't be used */
+static void ring_init()
+{
+	if (No_uring)
+		return;
+	if (uring_init(&Ring, 8) < 0)
+		return (void)fprintf(stderr, "io_uring: %m, using poll()\n");
+	if (!Threads && uring_read(&Ring, Cuse, Cuse_buf.buf, sizeof(Cuse_buf), RING_CUSE) < 0)
+		die("io_uring read: %m\n");
+}
 
-		timerclear(&diff);
-		Ping_time = now;
-		if (ping_send(Ping, Ping_id, Ping_seq, 0, Target))
-			die("ping_send: %m\n");
-		Ping_wait = true;
+static void threads_kick()
+{
+	if (write(Wake_fd, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0)
+		die("eventfd: %m\n");
+}
+
+/* serves requests from Cuse, and wakes readers when kicked; each waits
+ * exclusively, so a request or kick wakes only one of them */
+static void *thread_run(void *arg)
+{
+	struct epoll_event ev = { EPOLLIN | EPOLLEXCLUSIVE };
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	uint64_t n;
+	/* below every other thread, and preempted as soon as the probe thread
+	 * wakes, so a crowd of readers can't hold up the next pings even on
+	 * one CPU */
+	if ((errno = pthread_setschedparam(pthread_self(), SCHED_IDLE, &(struct sched_param){ 0 })))
+		die("pthread_setschedparam: %m\n");
+	if (ep < 0)
+		die("epoll_create: %m\n");
+	ev.data.fd = Cuse;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, Cuse, &ev) < 0)
+		die("epoll_ctl: %m\n");
+	ev.data.fd = Wake_fd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, Wake_fd, &ev) < 0)
+		die("epoll_ctl: %m\n");
+	while (1)
+	{
+		struct epoll_event evs[2];
+		int i, r = epoll_wait(ep, evs, 2, -1);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait: %m\n");
+		}
+		for (i = 0; i < r; i ++)
+		{
+			if (evs[i].data.fd == Wake_fd)
+			{
+				/* sharing any more with another thread */
+				if (read(Wake_fd, &n, sizeof(n)) == sizeof(n) && wake_readers())
+				{
+					threads_kick();
+					while (wake_readers());
+				}
+				continue;
+			}
+			/* another may have taken it */
+			ssize_t l = read(Cuse, Cuse_buf.buf, sizeof(Cuse_buf));
+			if (l < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			cuse_in(l);
+		}
 	}
+	return NULL;
+}
+
+static void threads_start()
+{
+	pthread_t thread;
+	unsigned i;
+	if (!Threads)
+		return;
+	if ((Wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		die("eventfd: %m\n");
+	/* as they all wait on it */
+	if (fcntl(Cuse, F_SETFL, fcntl(Cuse, F_GETFL) | O_NONBLOCK) < 0)
+		die("fcntl: %m\n");
+	for (i = 0; i < Threads; i ++)
+		if ((errno = pthread_create(&thread, NULL, &thread_run, NULL)))
+			die("pthread_create: %m\n");
+}
 
+static void loop()
+{
+	int64_t now = clock_update();
+	timer_run(&Timers, now);
+	send_flush();
+	bool more = false;
+	if (!Threads)
+		more = wake_readers();
+	else if (Wake_kick)
+		threads_kick();
+	Wake_kick = false;
+
+	int timeout = more ? 0 : timer_timeout(&Timers, now);
+	if (Ring.fd >= 0)
+		return ring_wait(timeout);
 	struct pollfd polls[2] = 
-		{ { .fd = Cuse, .events = POLLIN }
+		{ { .fd = Threads ? -1 : Cuse, .events = POLLIN }
 		, { .fd = Ping, .events = POLLIN }
 		};
-	int r = poll(polls, 2, 1000*(Interval - diff.tv_sec) - diff.tv_usec/1000);
+	int r = poll(polls, 2, timeout);
 	if (r < 0)
 		die("poll: %m\n");
 	if (polls[0].revents)
-		cuse_in();
-	if (polls[1].revents)
+		cuse_in(read(Cuse, Cuse_buf.buf, sizeof(Cuse_buf)));
+	if (polls[1].revents & POLLERR)
+		ping_err();
+	if (polls[1].revents & POLLIN)
 		ping_in();
 }
 
@@ -558,6 +1345,11 @@ static const struct argp_option Options[] =
 	, { "interval", 'i', "SECS", 0, "interval/timeout between pings [60]" }
 	, { "threshold", 't', "SECS", 0, "ping time to consider \"down\" [inf]" }
 	, { "count", 'c', "COUNT", 0, "number of consecutive pings to consider \"down\" [0=disabled]" }
+	, { "history", 'H', "COUNT", 0, "number of results to keep for each host [64]" }
+	, { "size", 's', "BYTES", 0, "send pings of BYTES, at least 60 to carry a timestamp for late replies [60]" }
+	, { "window", 'w', "SIZE", 0, "aggregate each host's last SIZE results, or SIZE s/m/h of them, up to 3 times [10, 5m, 1h]" }
+	, { "no-uring", 'N', 0, 0, "wait with poll() rather than io_uring" }
+	, { "threads", 'T', "COUNT", 0, "serve the device from COUNT threads [0: the one sending pings]" }
 	, { }
 	};
 
@@ -582,6 +1374,40 @@ static error_t parse_opt(int key, char *optarg, struct argp_state *state)
 				argp_error(state, "invalid count: %s", optarg);
 			return 0;
 
+		case 'H':
+			History = strtoul(optarg, &p, 10);
+			if (*p || !History || History > PINGDEV_HISTORY_MAX)
+				argp_error(state, "invalid history: %s", optarg);
+			return 0;
+
+		case 's': {
+			unsigned long n = strtoul(optarg, &p, 10);
+			if (*p || n < PING_MIN_SIZE || n > PING_MAX_SIZE)
+				argp_error(state, "invalid size: %s", optarg);
+			Ping_size = n;
+			return 0;
+		}
+
+		case 'w': {
+			unsigned long n = strtoul(optarg, &p, 10);
+			unsigned unit = !*p ? 0 : *p == 's' ? 1 : *p == 'm' ? 60 : *p == 'h' ? 3600 : -1;
+			if (!n || n > WINDOW_MAX || (*p && p[1]) || unit == -1 || Windows == PINGDEV_WINDOWS)
+				argp_error(state, "invalid window: %s", optarg);
+			Window_spec[Windows].n = n;
+			Window_spec[Windows++].unit = unit;
+			return 0;
+		}
+
+		case 'N':
+			No_uring = true;
+			return 0;
+
+		case 'T':
+			Threads = strtoul(optarg, &p, 10);
+			if (*p)
+				argp_error(state, "invalid threads: %s", optarg);
+			return 0;
+
 		case 't':
 			Threshold = strtof(optarg, &p);
 			if (*p || Threshold <= 0)
@@ -590,8 +1416,14 @@ static error_t parse_opt(int key, char *optarg, struct argp_state *state)
 
 		case ARGP_KEY_ARG:
 		{
-			if (Target.s_addr || !inet_aton(optarg, &Target))
+			struct in_addr a;
+			if (!inet_aton(optarg, &a))
 				argp_error(state, "invalid host: %s", optarg);
+			if (Targets_count % 64 == 0 && !(Targets = realloc(Targets, (Targets_count + 64) * sizeof(*Targets))))
+				die("realloc: %m\n");
+			if (!Targets_count)
+				Target_first = a;
+			Targets[Targets_count++] = (struct target){ .host = a };
 			return 0;
 		}
 
@@ -607,12 +1439,12 @@ static const struct argp Argp = {
 	.options = Options,
 	.parser = &parse_opt,
 	.args_doc = "HOST ...",
-	.doc = "Create a character device providing an ICMP ping interface."
+	.doc = "Create a character device providing an ICMP ping interface to each HOST, the first by default and the others once selected with PINGDEV_SET_TARGET."
 };
 
 int main(int argc, char **argv)
 {
-	if ((Ping = ping_open()) < 0)
+	if ((Ping = ping_open(0)) < 0)
 		die("ping_open: %m\n");
 
 	uid_t uid = getuid();
@@ -624,18 +1456,24 @@ int main(int argc, char **argv)
 		die("setuid: %m\n");
 
 	srand(getpid() ^ (intptr_t)*argv);
+	Ping_id = rand();
+	if (ping_bind(Ping, &Ping_id) < 0)
+		die("ping_bind: %m\n");
+	if (ping_filter(Ping, &Ping_id, 1) < 0)
+		die("ping_filter: %m\n");
 	if ((errno = argp_parse(&Argp, argc, argv, 0, 0, 0)))
 		die("argp_parse: %m\n");
 
 	cuse_init();
+	ring_init();
 	openlog("ping", 0, LOG_NEWS);
-	inet_ntop(AF_INET, &Target, Target_str, sizeof(Target_str));
+	targets_init();
+	threads_start();
 
 	if (signal(SIGTERM, &stop) == SIG_ERR ||
 			signal(SIGINT, &stop) == SIG_ERR)
 		die("signal: %m\n");
 
-	Ping_id = rand();
 	while (1)
 		loop();
 }
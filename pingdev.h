@@ -2,11 +2,62 @@
 #define PINGDEV_H
 
 #include <linux/ioctl.h>
+#include <stdint.h>
 
 #define PINGDEV_IOC_BASE	'P'
 
 #define PINGDEV_GET_PING	_IOR(PINGDEV_IOC_BASE, 1, float)
 #define PINGDEV_GET_INTERVAL	_IO(PINGDEV_IOC_BASE, 2)
 #define PINGDEV_GET_TARGET	_IOR(PINGDEV_IOC_BASE, 3, struct in_addr)
+/* switches the open file to another of the hosts monitored, or fails with
+ * ENOENT; the ioctls above and reads then apply to it */
+#define PINGDEV_SET_TARGET	_IOW(PINGDEV_IOC_BASE, 4, struct in_addr)
+/* with a nonzero argument, reads return the host's history as whole
+ * struct pingdev_record, those not yet read up to as many as fit, rather
+ * than text */
+#define PINGDEV_SET_BINARY	_IO(PINGDEV_IOC_BASE, 5)
+
+/* each host keeps a ring of its latest results, of up to
+ * PINGDEV_HISTORY_MAX */
+struct pingdev_record {
+	uint32_t seq;
+	float ping; /* seconds, INFINITY if lost */
+	int64_t time; /* sent, CLOCK_REALTIME ns */
+};
+
+#define PINGDEV_HISTORY_MAX	256
+
+struct pingdev_history {
+	uint32_t seq; /* in: the first wanted; out: that of rec[0], later if
+		       * those before are no longer kept */
+	uint32_t count; /* out, also returned */
+	struct pingdev_record rec[PINGDEV_HISTORY_MAX];
+};
+
+#define PINGDEV_GET_HISTORY	_IOWR(PINGDEV_IOC_BASE, 6, struct pingdev_history)
+
+/* aggregates of each host's results over up to PINGDEV_WINDOWS windows,
+ * each of a number of the latest results, updated with each; a late
+ * reply still counts as lost */
+#define PINGDEV_WINDOWS	3
+
+struct pingdev_window {
+	uint32_t size; /* results, 0 if unused */
+	uint32_t count; /* results in it so far, up to size */
+	uint32_t lost;
+	/* seconds, of the replies: */
+	float ewma; /* with a span of size */
+	float mean, stddev;
+	float min, p50, p90, p99, max; /* approximate, within about 6% */
+} __attribute__((packed));
+
+struct pingdev_stats {
+	uint32_t seq; /* results so far */
+	float jitter; /* seconds, RFC 3550's smoothed difference between
+		       * successive replies */
+	struct pingdev_window win[PINGDEV_WINDOWS];
+} __attribute__((packed));
+
+#define PINGDEV_GET_STATS	_IOR(PINGDEV_IOC_BASE, 7, struct pingdev_stats)
 
 #endif
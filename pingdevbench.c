@@ -0,0 +1,315 @@
+/* times pingdev's probes with and without many readers: pingdev is run from
+ * the current directory against a fake /dev/cuse, cuseshim.so, pinging
+ * HOSTS loopback addresses every second, and the spacing of each host's
+ * sends, as recorded in its history, is compared while idle and while
+ * HANDLES open files each read every result */
+#include <arpa/inet.h>
+#include <argp.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/fuse.h>
+#include "pingdev.h"
+
+static unsigned Handles = 10000;
+static unsigned Hosts = 200;
+static unsigned Secs = 10; /* of each phase */
+static char **Pingdev_args;
+static unsigned Pingdev_argc;
+
+static struct sockaddr_un Sock = { AF_UNIX };
+static pid_t Pingdev;
+static int Dev = -1;
+/* reads are numbered by handle, from 1, all else from REQ_BASE */
+#define REQ_BASE (1U << 24)
+static uint64_t Unique = REQ_BASE;
+static uint64_t *Fh; /* by handle */
+static char Buf[1 << 16] __attribute__((aligned(8)));
+
+static void die(const char *msg, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void die(const char *msg, ...)
+{
+	va_list args;
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	if (Pingdev > 0)
+		kill(Pingdev, SIGTERM);
+	unlink(Sock.sun_path);
+	exit(2);
+}
+
+static int64_t real_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void dev_send(uint64_t unique, uint32_t opcode, const void *arg, size_t len, const void *data, size_t data_len)
+{
+	struct fuse_in_header h = { sizeof(h) + len + data_len, opcode, unique };
+	struct iovec io[3] = { { &h, sizeof(h) }, { (void *)arg, len }, { (void *)data, data_len } };
+	if (writev(Dev, io, 3) < 0)
+		die("send: %m\n");
+}
+
+/* the next reply, or NULL if none in timeout ms */
+static struct fuse_out_header *dev_recv(int timeout)
+{
+	struct pollfd p = { Dev, POLLIN };
+	ssize_t r;
+	if (poll(&p, 1, timeout) <= 0)
+		return NULL;
+	if ((r = recv(Dev, Buf, sizeof(Buf), 0)) < (ssize_t)sizeof(struct fuse_out_header))
+		die("pingdev gone\n");
+	return (struct fuse_out_header *)Buf;
+}
+
+static void dev_read(unsigned handle)
+{
+	struct fuse_read_in in = { .fh = Fh[handle], .size = 256 };
+	dev_send(handle + 1, FUSE_READ, &in, sizeof(in), NULL, 0);
+}
+
+/* a read's reply to pass on to the next, as a reader would */
+static bool dev_reread(const struct fuse_out_header *o)
+{
+	if (!o->unique || o->unique > Handles)
+		return false;
+	dev_read(o->unique - 1);
+	return true;
+}
+
+/* waits for the reply to a request, dropping those to reads meanwhile */
+static struct fuse_out_header *dev_call(uint32_t opcode, const void *arg, size_t len, const void *data, size_t data_len)
+{
+	struct fuse_out_header *o;
+	uint64_t unique = Unique++;
+	dev_send(unique, opcode, arg, len, data, data_len);
+	while (1)
+	{
+		if (!(o = dev_recv(5000)))
+			die("no reply from pingdev\n");
+		if (o->unique == unique)
+			break;
+	}
+	if (o->error)
+	{
+		errno = -o->error;
+		die("pingdev request %u: %m\n", opcode);
+	}
+	return o;
+}
+
+static uint64_t dev_open()
+{
+	struct fuse_open_in in = { };
+	struct fuse_out_header *o = dev_call(FUSE_OPEN, &in, sizeof(in), NULL, 0);
+	return ((struct fuse_open_out *)(o + 1))->fh;
+}
+
+static struct fuse_out_header *dev_ioctl(uint64_t fh, uint32_t cmd, const void *data, size_t len, size_t out_size)
+{
+	struct fuse_ioctl_in in = { .fh = fh, .cmd = cmd, .in_size = len, .out_size = out_size };
+	return dev_call(FUSE_IOCTL, &in, sizeof(in), data, len);
+}
+
+static struct in_addr host(unsigned i)
+{
+	return (struct in_addr){ htonl(0x7F000100 + i + 1) };
+}
+
+static void start()
+{
+	char shim[4096], sock_env[sizeof(Sock.sun_path) + 16], **args;
+	int l, on = 64 << 20;
+	unsigned i, n = 0;
+
+	snprintf(Sock.sun_path, sizeof(Sock.sun_path), "/tmp/pingdevbench.%d", getpid());
+	if ((l = socket(PF_UNIX, SOCK_SEQPACKET, 0)) < 0 || bind(l, &Sock, SUN_LEN(&Sock)) < 0 || listen(l, 1) < 0)
+		die("%s: %m\n", Sock.sun_path);
+	if (!getcwd(shim, sizeof(shim) - sizeof("/cuseshim.so")))
+		die("getcwd: %m\n");
+	strcat(shim, "/cuseshim.so");
+
+	if (!(args = calloc(8 + Pingdev_argc + Hosts, sizeof(*args))))
+		die("malloc: %m\n");
+	args[n++] = "./pingdev";
+	args[n++] = "-i1";
+	args[n++] = "-H64";
+	for (i = 0; i < Pingdev_argc; i ++)
+		args[n++] = Pingdev_args[i];
+	for (i = 0; i < Hosts; i ++)
+		args[n++] = strdup(inet_ntoa(host(i)));
+	if ((Pingdev = fork()) < 0)
+		die("fork: %m\n");
+	if (!Pingdev)
+	{
+		snprintf(sock_env, sizeof(sock_env), "CUSE_SOCK=%s", Sock.sun_path);
+		putenv(sock_env);
+		setenv("LD_PRELOAD", shim, 1);
+		execv(args[0], args);
+		fprintf(stderr, "%s: %m\n", args[0]);
+		_exit(2);
+	}
+
+	struct pollfd p = { l, POLLIN };
+	if (poll(&p, 1, 5000) <= 0 || (Dev = accept(l, NULL, NULL)) < 0)
+		die("pingdev didn't open /dev/cuse: %m\n");
+	close(l);
+	unlink(Sock.sun_path);
+	if (setsockopt(Dev, SOL_SOCKET, SO_SNDBUFFORCE, &on, sizeof(on)) < 0)
+		setsockopt(Dev, SOL_SOCKET, SO_SNDBUF, &on, sizeof(on));
+	if (setsockopt(Dev, SOL_SOCKET, SO_RCVBUFFORCE, &on, sizeof(on)) < 0)
+		setsockopt(Dev, SOL_SOCKET, SO_RCVBUF, &on, sizeof(on));
+
+	struct cuse_init_in init = { FUSE_KERNEL_VERSION, FUSE_KERNEL_MINOR_VERSION };
+	dev_call(CUSE_INIT, &init, sizeof(init), NULL, 0);
+}
+
+static int float_cmp(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+	return x < y ? -1 : x > y;
+}
+
+struct jitter {
+	float *dev; /* ms off the interval */
+	unsigned count;
+	float p50, p99, max;
+};
+
+/* the spacing of sends recorded between from and to, after the first two
+ * of each host's, which are spread over the interval */
+static void jitter(uint64_t fh, int64_t from, int64_t to, struct jitter *j)
+{
+	struct fuse_out_header *o;
+	struct pingdev_history *hist;
+	unsigned i, k;
+	uint32_t seq = 0;
+	j->count = 0;
+	if (!(j->dev = malloc(Hosts * PINGDEV_HISTORY_MAX * sizeof(*j->dev))))
+		die("malloc: %m\n");
+	for (i = 0; i < Hosts; i ++)
+	{
+		struct in_addr a = host(i);
+		dev_ioctl(fh, PINGDEV_SET_TARGET, &a, sizeof(a), 0);
+		o = dev_ioctl(fh, PINGDEV_GET_HISTORY, &seq, sizeof(seq), sizeof(*hist));
+		hist = (struct pingdev_history *)((char *)(o + 1) + sizeof(struct fuse_ioctl_out));
+		for (k = 1; k < hist->count; k ++)
+			if (hist->rec[k-1].seq >= 2 && hist->rec[k-1].time >= from && hist->rec[k].time < to)
+				j->dev[j->count++] = fabsf((hist->rec[k].time - hist->rec[k-1].time) / 1e6f - 1000);
+	}
+	if (!j->count)
+		die("no sends recorded\n");
+	qsort(j->dev, j->count, sizeof(*j->dev), &float_cmp);
+	j->p50 = j->dev[j->count / 2];
+	j->p99 = j->dev[j->count * 99 / 100];
+	j->max = j->dev[j->count - 1];
+	free(j->dev);
+}
+
+static const struct argp_option Options[] =
+	{ { "handles", 'n', "COUNT", 0, "read every result from COUNT open files [10000]" }
+	, { "hosts", 'H', "COUNT", 0, "ping COUNT loopback addresses, up to 250 [200]" }
+	, { "time", 't', "SECS", 0, "run each phase for SECS, up to 30 [10]" }
+	, { }
+	};
+
+static error_t parse_opt(int key, char *optarg, struct argp_state *state)
+{
+	char *p;
+	switch (key) {
+		case 'n':
+			Handles = strtoul(optarg, &p, 10);
+			if (*p || Handles >= REQ_BASE)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 'H':
+			Hosts = strtoul(optarg, &p, 10);
+			if (*p || !Hosts || Hosts > 250)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 't':
+			Secs = strtoul(optarg, &p, 10);
+			if (*p || !Secs || Secs > 30)
+				argp_error(state, "invalid time: %s", optarg);
+			return 0;
+
+		case ARGP_KEY_ARGS:
+			Pingdev_args = state->argv + state->next;
+			Pingdev_argc = state->argc - state->next;
+			return 0;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+}
+
+static const struct argp Argp = {
+	.options = Options,
+	.parser = &parse_opt,
+	.args_doc = "[-- PINGDEV_OPTION...]",
+	.doc = "Check that pingdev's probes keep to time with many readers waiting."
+};
+
+int main(int argc, char **argv)
+{
+	struct fuse_out_header *o;
+	struct jitter idle, busy;
+	int64_t t0, t1, t2, end;
+	unsigned i, served = 0;
+	uint64_t g;
+
+	if ((errno = argp_parse(&Argp, argc, argv, 0, 0, 0)))
+		die("argp_parse: %m\n");
+	start();
+	g = dev_open();
+
+	t0 = real_ns();
+	sleep(Secs);
+	t1 = real_ns();
+
+	if (!(Fh = calloc(Handles, sizeof(*Fh))))
+		die("malloc: %m\n");
+	for (i = 0; i < Handles; i ++)
+		Fh[i] = dev_open();
+	for (i = 0; i < Handles; i ++)
+		dev_read(i);
+	end = t1 + Secs * 1000000000LL;
+	while ((t2 = real_ns()) < end)
+		if ((o = dev_recv((end - t2) / 1000000 + 1)) && dev_reread(o))
+			served ++;
+
+	jitter(g, t0, t1, &idle);
+	jitter(g, t1, t2, &busy);
+	kill(Pingdev, SIGTERM);
+	waitpid(Pingdev, NULL, 0);
+
+	printf("sends off the 1s interval, in ms:\n");
+	printf("%10s %6s %8s %8s %8s %8s\n", "readers", "sends", "reads", "p50", "p99", "max");
+	printf("%10u %6u %8u %8.3f %8.3f %8.3f\n", 0, idle.count, 0, idle.p50, idle.p99, idle.max);
+	printf("%10u %6u %8u %8.3f %8.3f %8.3f\n", Handles, busy.count, served, busy.p50, busy.p99, busy.max);
+	/* flat enough, allowing for scheduling noise */
+	if (busy.p99 > 2 * idle.p99 + 1)
+	{
+		printf("send jitter grows with readers\n");
+		return 1;
+	}
+	return 0;
+}
@@ -1,10 +1,15 @@
 #include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/socket.h>
+#include <string.h>
 #include <unistd.h>
-#include "pinger.h"
+#include "libpinger.h"
+
+#define TIMEOUT	5000000
 
 static void die(const char *msg, ...) __attribute__((format(printf, 1, 2), noreturn));
 static void die(const char *msg, ...)
@@ -16,38 +21,94 @@ static void die(const char *msg, ...)
 	exit(1);
 }
 
-int main(int argc, char **argv)
+static void result(void *arg, const struct pinger_result *r)
 {
-	int s, i, n = 0;
-	struct sockaddr_un la = { AF_UNIX }, sa = { AF_UNIX, PINGER_SOCKET };
-
-	if ((s = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0)
-		die("socket: %m\n");
-	if (bind(s, &la, SUN_LEN(&la)) < 0)
-		die("bind: %m\n");
-	if (connect(s, &sa, SUN_LEN(&sa)) < 0)
-		die("connect: %m\n");
-	for (i = 1; i < argc; i ++)
+	printf("%s: %d\n", (char *)arg, r->time);
+}
+
+static void result_free(void *arg, const struct pinger_result *r)
+{
+	result(arg, r);
+	free(arg);
+}
+
+static void submit(struct pinger_client *c, char *name, pinger_fn *fn)
+{
+	struct in_addr a;
+	if (!inet_aton(name, &a))
+	{
+		fprintf(stderr, "invalid IP: %s\n", name);
+		if (fn == &result_free)
+			free(name);
+		return;
+	}
+	/* wait for room rather than lose it */
+	while (pinger_submit(c, a.s_addr, TIMEOUT, 0, fn, name) < 0)
+	{
+		struct pollfd p = { pinger_fd(c), POLLOUT };
+		if (errno != EAGAIN)
+			die("pinger_submit: %m\n");
+		if (poll(&p, 1, -1) < 0 && errno != EINTR)
+			die("poll: %m\n");
+	}
+}
+
+/* submit each whole line read from stdin; returns 0 at EOF */
+static int read_hosts(struct pinger_client *c)
+{
+	static char buf[4096];
+	static size_t len;
+	char *p, *e;
+	ssize_t r = read(0, buf + len, sizeof(buf) - 1 - len);
+	if (r < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		die("read: %m\n");
+	}
+	len += r;
+	/* the last line needn't be ended, nor one too long to fit */
+	if (!r || (len == sizeof(buf) - 1 && !memchr(buf, '\n', len)))
+		buf[len++] = '\n';
+	for (p = buf; (e = memchr(p, '\n', len - (p - buf))); p = e + 1)
 	{
-		struct in_addr a;
-		if (!inet_aton(argv[i], &a))
-		{
-			fprintf(stderr, "invalid IP: %s\n", argv[i]);
-			continue;
-		}
-		struct ping p = { a.s_addr, 5000000 };
-		if (send(s, &p, sizeof(p), 0) < 0)
-			die("send: %m\n");
-		n ++;
+		*e = 0;
+		if (e > p)
+			submit(c, strndup(p, e - p), &result_free);
 	}
-	for (i = 0; i < n; i ++)
+	len -= p - buf;
+	memmove(buf, p, len);
+	return r > 0;
+}
+
+/* pings the hosts given, or those read from stdin as they're read */
+int main(int argc, char **argv)
+{
+	struct pinger_client *c;
+	int i;
+	bool input = argc < 2;
+
+	if (!(c = pinger_open(NULL)))
+		die("pinger: %m\n");
+	for (i = 1; i < argc; i ++)
+		submit(c, argv[i], &result);
+	if (input)
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	while (input || pinger_pending(c))
 	{
-		struct ping p = {};
-		if (recv(s, &p, sizeof(p), 0) < 0)
+		struct pollfd polls[2] =
+			{ { .fd = pinger_fd(c), .events = POLLIN }
+			, { .fd = input ? 0 : -1, .events = POLLIN }
+			};
+		if (pinger_flush(c) < 0 && errno == EAGAIN)
+			polls[0].events |= POLLOUT;
+		if (poll(polls, 2, pinger_timeout(c)) < 0 && errno != EINTR)
+			die("poll: %m\n");
+		if (polls[1].revents)
+			input = read_hosts(c);
+		if (pinger_process(c) < 0)
 			die("recv: %m\n");
-		struct in_addr a = { p.host };
-		printf("%s: %d\n", inet_ntoa(a), p.time);
 	}
-	close(s);
+	pinger_close(c);
 	return 0;
 }
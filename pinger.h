@@ -13,4 +13,131 @@ struct ping {
 	int32_t time; /* us, -errno */
 };
 
+/* Batches of any number of targets, up to PINGER_BATCH_MAX, in one datagram.
+ * A datagram of sizeof(struct ping) is always a single request or result,
+ * so batches can't be empty.  Results are returned in batches as they come
+ * in, tagged as requested, in the version of the request. */
+#define PINGER_MAGIC	0x676e6950 /* "Ping" */
+#define PINGER_VERSION	2
+#define PINGER_BATCH_MAX	256
+
+enum pinger_type {
+	PINGER_REQUEST = 1,
+	PINGER_RESULT,
+	/* of struct pinger_sub, with results streamed back until done */
+	PINGER_SUBSCRIBE,
+	/* of struct pinger_target, by tag, each answered -ECANCELED or -ENOENT */
+	PINGER_CANCEL,
+	/* of one struct pinger_target, whose tag is the format of the reply */
+	PINGER_STATS,
+};
+
+struct pinger_hdr {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint16_t count;
+};
+
+struct pinger_target {
+	uint32_t tag;
+	in_addr_t host;
+	int32_t time; /* request: timeout, result: as in struct ping */
+	/* request: oldest result to accept from recent pings of host, or 0 to
+	 * always ping; result: how old it is; in us */
+	uint32_t age;
+};
+
+/* version 1 targets, without age */
+struct pinger_target_v1 {
+	uint32_t tag;
+	in_addr_t host;
+	int32_t time;
+};
+
+/* ping host every interval, count times or until cancelled if 0, with
+ * results tagged as given; subscriptions end if results can't be delivered,
+ * and are refused with -ENFILE over pingerd's limits per user or in all */
+#define PINGER_MIN_INTERVAL	10000
+struct pinger_sub {
+	uint32_t tag;
+	in_addr_t host;
+	int32_t time; /* timeout of each */
+	uint32_t interval; /* us */
+	uint32_t count;
+};
+
+/* PINGER_STATS replies: a struct pinger_stats, or "name value" lines */
+enum pinger_stats_format {
+	PINGER_STATS_BINARY,
+	PINGER_STATS_TEXT,
+};
+
+enum pinger_stat {
+	PINGER_STAT_UPTIME, /* ms */
+	PINGER_STAT_REQUESTS, /* targets asked for, including by subscriptions */
+	/* results by outcome */
+	PINGER_STAT_OK,
+	PINGER_STAT_CACHED, /* also counted as ok */
+	PINGER_STAT_TIMEOUT,
+	PINGER_STAT_INVALID, /* -EINVAL */
+	PINGER_STAT_DENIED, /* -EACCES, by the filters */
+	PINGER_STAT_QUEUE_FULL, /* -ENFILE */
+	PINGER_STAT_BUSY, /* -EAGAIN, out of pingers */
+	PINGER_STAT_ERROR, /* anything else */
+	/* probes */
+	PINGER_STAT_SENT,
+	PINGER_STAT_REPLIES,
+	PINGER_STAT_UNMATCHED, /* replies to nothing in flight, e.g. too late */
+	PINGER_STAT_COALESCED, /* requests that joined a probe in flight */
+	PINGER_STAT_DROPS, /* by the kernel on the ICMP sockets */
+	/* current */
+	PINGER_STAT_IN_FLIGHT,
+	PINGER_STAT_QUEUED,
+	PINGER_STAT_SUBS,
+	PINGER_STAT_COUNT
+};
+
+/* log-linear histograms: a bucket for each value below PINGER_HIST_SUB, then
+ * PINGER_HIST_SUB to each power of two up to 2^32, so within 1/16th; the
+ * last bucket also counts anything larger */
+#define PINGER_HIST_SUB_BITS	4
+#define PINGER_HIST_SUB	(1U << PINGER_HIST_SUB_BITS)
+#define PINGER_HIST_BUCKETS	((32 - PINGER_HIST_SUB_BITS + 1) * PINGER_HIST_SUB)
+struct pinger_hist {
+	uint64_t count, sum;
+	uint64_t bucket[PINGER_HIST_BUCKETS];
+};
+
+static inline unsigned pinger_hist_bucket(uint64_t v)
+{
+	if (v < PINGER_HIST_SUB)
+		return v;
+	unsigned e = 63 - __builtin_clzll(v);
+	unsigned i = (e - PINGER_HIST_SUB_BITS + 1) * PINGER_HIST_SUB
+		+ ((v >> (e - PINGER_HIST_SUB_BITS)) & (PINGER_HIST_SUB - 1));
+	return i < PINGER_HIST_BUCKETS ? i : PINGER_HIST_BUCKETS - 1;
+}
+
+/* the smallest value counted in bucket i */
+static inline uint64_t pinger_hist_min(unsigned i)
+{
+	if (i < PINGER_HIST_SUB)
+		return i;
+	return (uint64_t)(PINGER_HIST_SUB + i % PINGER_HIST_SUB) << (i / PINGER_HIST_SUB - 1);
+}
+
+struct pinger_stats {
+	struct pinger_hdr h; /* PINGER_STATS, count 1 */
+	uint64_t counter[PINGER_STAT_COUNT];
+	struct pinger_hist rtt; /* us */
+	struct pinger_hist delay; /* us from request to send */
+	struct pinger_hist loop; /* ns to handle each wakeup of each thread */
+};
+
+struct pinger_batch {
+	struct pinger_hdr h;
+	struct pinger_target t[PINGER_BATCH_MAX];
+};
+
 #endif
@@ -8,6 +8,8 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -18,39 +20,239 @@
 #include <time.h>
 #include <argp.h>
 #include <grp.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/sock_diag.h>
 #include "pinger.h"
 #include "ping.h"
+#include "timer.h"
+#include "lpm.h"
+#include "clock.h"
 
 static int Server = -1;
-static int Icmp = -1;
 static struct sockaddr_un Server_addr = { AF_UNIX, PINGER_SOCKET };
 static bool Socket_created;
 static const char *Group;
-static unsigned Rate = 60, Rate_period = 60; /* 60/minute */
+static int64_t Started;
+
+/* token bucket holding up to count tokens, refilled at count per period */
+struct bucket {
+	unsigned count, period;
+	double tokens;
+	int64_t last;
+};
+static struct bucket Rate = { 60, 60, 60 }; /* 60/minute */
+static struct bucket Client_rate; /* each user's, defaults to Rate */
+static uint16_t Ping_size = PING_STAMP_SIZE;
 
-#define MAX_FILTERS	16
 enum filter_type {
 	FILTER_ACCEPT = 0,
 	FILTER_REJECT,
 	FILTER_TYPES
 };
+/* networks given directly or in files, which are reread on SIGHUP */
+struct filter_source {
+	const char *arg;
+	bool file;
+};
 static struct filter {
+	struct filter_source *src;
 	unsigned count;
-	struct netmask filters[MAX_FILTERS];
+	struct lpm lpm;
 } Filter[FILTER_TYPES];
 
-static struct pinger {
-	struct sockaddr_un client;
-	socklen_t client_len;
-	struct ping req;
-	struct timeval sent;
+/* an echo request, shared by every request for its host while in flight */
+struct probe {
+	in_addr_t host;
 	uint16_t id;
 	uint16_t seq;
 	uint16_t size;
+	bool sent_tx; /* sent is the kernel's departure time */
+	int64_t sent;
+	int64_t requested; /* by the pinger that started it */
+	uint64_t cookie;
+	struct pinger *waiters;
+} __attribute__((aligned(64)));
+
+struct pinger {
+	struct sockaddr_un client;
+	socklen_t client_len;
+	struct worker *w; /* whose timers and results it's on */
+	struct client *queue; /* while waiting for tokens */
+	struct pinger *qprev, *qnext;
+	struct probe *probe; /* once waiting for one */
+	struct pinger *wprev, *wnext;
+	struct ping req;
+	uint8_t version; /* of the batch, 0 for a single struct ping */
+	uint32_t tag;
+	uint32_t max_age;
 	uint32_t timeout;
-	struct pinger *next, **prev;
-} *Pings;
-static uint16_t Seq;
+	int64_t at; /* when asked for */
+	struct timer timer;
+} __attribute__((aligned(64)));
+
+/* per-user rate limits, with requests over them queued and released
+ * round-robin (deficit round robin with unit cost) as tokens refill */
+#define CLIENT_HASH	64
+#define DRR_QUANTUM	4
+struct client {
+	struct client *next; /* in Clients */
+	uid_t uid;
+	struct bucket bucket;
+	struct pinger *head, *tail;
+	unsigned queued, deficit;
+	struct client *active_next; /* in Active */
+	bool active;
+	struct sub *subs;
+	unsigned sub_count;
+};
+static struct client *Clients[CLIENT_HASH];
+static struct {
+	struct client *head, *tail;
+	unsigned queued;
+} Active;
+static unsigned Queue_max = 256; /* per user */
+
+/* pings scheduled here on behalf of a client, limited per user and in all */
+struct sub {
+	struct sub *next, *prev; /* in its user's subs */
+	struct sockaddr_un client;
+	socklen_t client_len;
+	struct client *user;
+	struct pinger_sub req;
+	struct timer timer;
+};
+static unsigned Sub_count;
+static unsigned Sub_max = 4096, Sub_user_max = 64;
+
+/* results, coalesced per client and sent together */
+struct result {
+	struct sockaddr_un client;
+	socklen_t client_len;
+	uint8_t version;
+	size_t len;
+	union {
+		struct ping ping;
+		struct pinger_batch batch;
+		struct {
+			struct pinger_hdr h;
+			struct pinger_target_v1 t[PINGER_BATCH_MAX];
+		} batch_v1;
+	} msg;
+};
+
+/* clients found gone by workers, for Main to drop their subscriptions */
+#define GONE_MAX	16
+static struct {
+	pthread_mutex_t lock;
+	unsigned count;
+	socklen_t client_len[GONE_MAX];
+	struct sockaddr_un client[GONE_MAX];
+} Gone = { PTHREAD_MUTEX_INITIALIZER };
+
+/* recent results by host, the least recently used replaced first */
+struct cached {
+	in_addr_t host;
+	int32_t time;
+	int64_t at;
+	struct cached *next; /* in hash chain */
+	struct cached *lru_prev, *lru_next;
+};
+static struct cache {
+	pthread_mutex_t lock;
+	struct cached *entry, **hash;
+	unsigned size, count, bits;
+	struct cached lru; /* most recent first */
+	/* stats: */
+	unsigned long hits, misses;
+} Cache = { PTHREAD_MUTEX_INITIALIZER, .size = 1024 };
+
+/* slab allocators, with an optional cap on those in use */
+#define POOL_SLAB	64
+struct pool {
+	size_t size;
+	void *free; /* linked through their first word */
+	unsigned used, max;
+	/* stats: */
+	unsigned high, slabs;
+	unsigned long exhausted;
+};
+static struct pool Pool = { sizeof(struct pinger) };
+static pthread_mutex_t Pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* open addressing index of probes in flight, by host since there's only
+ * ever one for each */
+struct table {
+	struct probe **slot;
+	unsigned bits;
+	unsigned count;
+	/* stats: */
+	unsigned long lookups, probes;
+	unsigned max_probe;
+};
+
+/* an ICMP socket and the probes in flight on it.  Main also queues,
+ * schedules and answers requests; with --workers, each worker has a
+ * thread of its own for a share of the hosts, given probes by Main under
+ * its lock, and Main has no socket. */
+struct worker {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int icmp;
+	uint16_t id; /* for ping sockets, which only use one */
+	bool id_bound;
+	unsigned id_lo, id_span; /* range of ids for raw sockets */
+	int wake; /* eventfd to rouse the thread */
+	bool kick; /* handed new probes since last roused */
+	struct timers timers;
+	struct table table;
+	struct pool probes;
+	uint16_t seq;
+	uint64_t cookie;
+	/* probes ready to send together */
+	struct probe *send_queue[PING_BATCH];
+	unsigned send_count;
+	struct result results[PING_BATCH];
+	unsigned result_count;
+	/* stats, of which only the counts in pinger_stat order are used */
+	uint64_t counter[PINGER_STAT_COUNT];
+	struct pinger_hist rtt, delay, loop;
+};
+static struct worker Main = { PTHREAD_MUTEX_INITIALIZER, .icmp = -1, .wake = -1, .probes = { sizeof(struct probe) } };
+static struct worker *Workers;
+static unsigned Worker_count;
+#define WORKER_MAX	64
+
+/* a worker's stats are only written under its lock (Main's by the main
+ * thread) but read by anyone, so relaxed loads and stores are enough */
+static inline void stat_add(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_inc(struct worker *w, enum pinger_stat s)
+{
+	stat_add(&w->counter[s], 1);
+}
+
+static inline void hist_add(struct pinger_hist *h, uint64_t v)
+{
+	stat_add(&h->count, 1);
+	stat_add(&h->sum, v);
+	stat_add(&h->bucket[pinger_hist_bucket(v)], 1);
+}
+static volatile sig_atomic_t Dump_stats, Reload;
+
+static void stats(int sig)
+{
+	Dump_stats = 1;
+}
+
+static void reload(int sig)
+{
+	Reload = 1;
+}
 
 static void stop(int sig) __attribute__((noreturn));
 static void stop(int sig) 
@@ -76,6 +278,9 @@ static void open_server()
 		die("server socket: %m\n");
 	if (fcntl(Server, F_SETFL, O_NONBLOCK) < 0)
 		die("server fcntl O_NONBLOCK: %m\n");
+	int on = 1;
+	if (setsockopt(Server, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+		die("server SO_PASSCRED: %m\n");
 	if (unlink(Server_addr.sun_path) == -1 && errno != ENOENT)
 		die("unlink %s: %m\n", Server_addr.sun_path);
 	mode_t omask = umask(0177);
@@ -89,162 +294,1374 @@ static void open_server()
 			chmod(Server_addr.sun_path, 0660);
 }
 
-static inline bool test_netmask(const struct netmask nm, in_addr_t ip)
+static int filter_add(struct lpm *l, const char *net)
 {
-	return (ip & nm.mask) == nm.net;
+	struct netmask nm;
+	if (parse_netmask(&nm, net) < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return lpm_add(l, nm.net, __builtin_popcount(nm.mask));
 }
 
-static bool test_filters(in_addr_t ip)
+/* one network per line, with # comments */
+static int filter_read(struct lpm *l, const char *path)
 {
-	unsigned i;
-	for (i = 0; i < Filter[FILTER_ACCEPT].count; i ++)
-		if (test_netmask(Filter[FILTER_ACCEPT].filters[i], ip))
+	FILE *f = fopen(path, "r");
+	char *line = NULL, *p, *e;
+	size_t size = 0;
+	unsigned n = 0;
+	int r = 0;
+	if (!f)
+	{
+		fprintf(stderr, "%s: %m\n", path);
+		return -1;
+	}
+	while (getline(&line, &size, f) >= 0)
+	{
+		n ++;
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		for (p = line; *p == ' ' || *p == '\t'; p ++);
+		for (e = p + strlen(p); e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' || e[-1] == '\r'); e --);
+		if (e == p)
+			continue;
+		*e = 0;
+		if ((r = filter_add(l, p)) < 0)
+		{
+			fprintf(stderr, "%s:%u: %s: %m\n", path, n, p);
 			break;
-	if (i && i == Filter[FILTER_ACCEPT].count)
+		}
+	}
+	free(line);
+	fclose(f);
+	return r;
+}
+
+/* rebuild all filters, replacing them only if all load */
+static int filter_load()
+{
+	struct lpm lpm[FILTER_TYPES] = {};
+	unsigned t, i;
+	for (t = 0; t < FILTER_TYPES; t ++)
+		for (i = 0; i < Filter[t].count; i ++)
+		{
+			const struct filter_source *s = &Filter[t].src[i];
+			if (s->file ? filter_read(&lpm[t], s->arg) < 0 : filter_add(&lpm[t], s->arg) < 0)
+			{
+				if (!s->file)
+					fprintf(stderr, "%s: %m\n", s->arg);
+				for (t = 0; t < FILTER_TYPES; t ++)
+					lpm_free(&lpm[t]);
+				return -1;
+			}
+		}
+	for (t = 0; t < FILTER_TYPES; t ++)
+	{
+		lpm_free(&Filter[t].lpm);
+		Filter[t].lpm = lpm[t];
+	}
+	return 0;
+}
+
+static bool test_filters(in_addr_t ip)
+{
+	if (Filter[FILTER_ACCEPT].count && lpm_match(&Filter[FILTER_ACCEPT].lpm, ip) < 0)
 		return false;
-	for (i = 0; i < Filter[FILTER_REJECT].count; i ++)
-		if (test_netmask(Filter[FILTER_REJECT].filters[i], ip))
-			return false;
-	return true;
+	return lpm_match(&Filter[FILTER_REJECT].lpm, ip) < 0;
+}
+
+static void bucket_fill(struct bucket *b, int64_t now)
+{
+	b->tokens += (double)(now - b->last) / NSEC * b->count / b->period;
+	if (b->tokens > b->count)
+		b->tokens = b->count;
+	b->last = now;
+}
+
+/* ms until the next token */
+static int bucket_wait(const struct bucket *b)
+{
+	return (1 - b->tokens) * b->period * 1000 / b->count + 1;
+}
+
+static struct client *client_get(uid_t uid, int64_t now)
+{
+	struct client **cp = &Clients[uid % CLIENT_HASH], *c;
+	for (c = *cp; c; c = c->next)
+		if (c->uid == uid)
+			return c;
+	if (!(c = calloc(1, sizeof(*c))))
+		die("malloc(client): %m\n");
+	c->uid = uid;
+	c->bucket = Client_rate.count ? Client_rate : Rate;
+	c->bucket.tokens = c->bucket.count;
+	c->bucket.last = now;
+	c->next = *cp;
+	*cp = c;
+	return c;
+}
+
+static void queue_push(struct client *c, struct pinger *p)
+{
+	p->queue = c;
+	p->qnext = NULL;
+	if ((p->qprev = c->tail))
+		c->tail->qnext = p;
+	else
+		c->head = p;
+	c->tail = p;
+	c->queued ++;
+	Active.queued ++;
+	if (!c->active)
+	{
+		c->active = true;
+		c->active_next = NULL;
+		if (Active.tail)
+			Active.tail->active_next = c;
+		else
+			Active.head = c;
+		Active.tail = c;
+	}
+}
+
+/* clients with nothing left queued are dropped from Active as it's walked */
+static void queue_del(struct pinger *p)
+{
+	struct client *c = p->queue;
+	if (p->qprev)
+		p->qprev->qnext = p->qnext;
+	else
+		c->head = p->qnext;
+	if (p->qnext)
+		p->qnext->qprev = p->qprev;
+	else
+		c->tail = p->qprev;
+	p->queue = NULL;
+	c->queued --;
+	Active.queued --;
+}
+
+static inline unsigned table_hash(const struct table *tb, in_addr_t host)
+{
+	return (host * 0x9E3779B97F4A7C15ULL) >> (64 - tb->bits);
+}
+
+static void table_put(struct table *tb, struct probe *p)
+{
+	unsigned m = (1U << tb->bits) - 1;
+	unsigned i = table_hash(tb, p->host);
+	while (tb->slot[i])
+		i = (i + 1) & m;
+	tb->slot[i] = p;
+}
+
+static void table_add(struct table *tb, struct probe *p)
+{
+	if (!tb->bits || 4*(tb->count+1) > 3U << tb->bits)
+	{
+		struct probe **old = tb->slot;
+		unsigned i, n = tb->bits ? 1U << tb->bits : 0;
+		tb->bits = tb->bits ? tb->bits + 1 : 8;
+		if (!(tb->slot = calloc(1U << tb->bits, sizeof(*tb->slot))))
+			die("malloc(table): %m\n");
+		for (i = 0; i < n; i ++)
+			if (old[i])
+				table_put(tb, old[i]);
+		free(old);
+	}
+	table_put(tb, p);
+	tb->count ++;
+}
+
+static struct probe *table_host(struct table *tb, in_addr_t host)
+{
+	if (!tb->count)
+		return NULL;
+	unsigned m = (1U << tb->bits) - 1;
+	unsigned i = table_hash(tb, host), n = 1;
+	struct probe *p;
+	for (; (p = tb->slot[i]); i = (i + 1) & m, n ++)
+		if (p->host == host)
+			break;
+	tb->lookups ++;
+	tb->probes += n;
+	if (n > tb->max_probe)
+		tb->max_probe = n;
+	return p;
+}
+
+static struct probe *table_find(struct table *tb, const struct ping_pkt *r)
+{
+	struct probe *p = table_host(tb, r->host.s_addr);
+	if (p && r->id == p->id && r->seq == p->seq
+			&& (!r->cookie || r->cookie == p->cookie))
+		return p;
+	return NULL;
+}
+
+static void table_del(struct table *tb, struct probe *p)
+{
+	unsigned m = (1U << tb->bits) - 1;
+	unsigned i = table_hash(tb, p->host), j, h;
+	while (tb->slot[i] != p)
+		i = (i + 1) & m;
+	/* shift back later entries of the run that would no longer be found */
+	for (j = (i + 1) & m; tb->slot[j]; j = (j + 1) & m)
+	{
+		h = table_hash(tb, tb->slot[j]->host);
+		if (((j - h) & m) >= ((j - i) & m))
+		{
+			tb->slot[i] = tb->slot[j];
+			i = j;
+		}
+	}
+	tb->slot[i] = NULL;
+	tb->count --;
+}
+
+static int64_t cache_age(const struct cached *c, int64_t now)
+{
+	return (now - c->at) / USEC;
+}
+
+static inline unsigned cache_hash(in_addr_t host)
+{
+	return (host * 0x9E3779B97F4A7C15ULL) >> (64 - Cache.bits);
+}
+
+static struct cached *cache_find(in_addr_t host)
+{
+	struct cached *c;
+	for (c = Cache.hash[cache_hash(host)]; c; c = c->next)
+		if (c->host == host)
+			return c;
+	return NULL;
+}
+
+static void cache_unlink(struct cached *c)
+{
+	c->lru_prev->lru_next = c->lru_next;
+	c->lru_next->lru_prev = c->lru_prev;
+}
+
+static void cache_front(struct cached *c)
+{
+	c->lru_next = Cache.lru.lru_next;
+	c->lru_prev = &Cache.lru;
+	c->lru_next->lru_prev = c;
+	Cache.lru.lru_next = c;
+}
+
+static void cache_put(in_addr_t host, int32_t time, int64_t now)
+{
+	struct cached *c, **cp;
+	if (!Cache.size)
+		return;
+	pthread_mutex_lock(&Cache.lock);
+	if (!Cache.entry)
+	{
+		for (Cache.bits = 1; 1U << Cache.bits < Cache.size; Cache.bits ++);
+		if (!(Cache.entry = calloc(Cache.size, sizeof(*Cache.entry)))
+				|| !(Cache.hash = calloc(1U << Cache.bits, sizeof(*Cache.hash))))
+			die("malloc(cache): %m\n");
+		Cache.lru.lru_next = Cache.lru.lru_prev = &Cache.lru;
+	}
+	if ((c = cache_find(host)))
+		cache_unlink(c);
+	else
+	{
+		if (Cache.count < Cache.size)
+			c = &Cache.entry[Cache.count++];
+		else
+		{
+			c = Cache.lru.lru_prev;
+			cache_unlink(c);
+			for (cp = &Cache.hash[cache_hash(c->host)]; *cp != c; cp = &(*cp)->next);
+			*cp = c->next;
+		}
+		c->host = host;
+		cp = &Cache.hash[cache_hash(host)];
+		c->next = *cp;
+		*cp = c;
+	}
+	c->time = time;
+	c->at = now;
+	cache_front(c);
+	pthread_mutex_unlock(&Cache.lock);
+}
+
+/* a result for host no older than max_age us, and its age */
+static bool cache_get(in_addr_t host, uint32_t max_age, int64_t now, int32_t *time, uint32_t *age)
+{
+	struct cached *c;
+	bool r = false;
+	pthread_mutex_lock(&Cache.lock);
+	if (!Cache.count || !(c = cache_find(host)) || cache_age(c, now) > max_age)
+		Cache.misses ++;
+	else
+	{
+		Cache.hits ++;
+		cache_unlink(c);
+		cache_front(c);
+		*time = c->time;
+		*age = cache_age(c, now);
+		r = true;
+	}
+	pthread_mutex_unlock(&Cache.lock);
+	return r;
+}
+
+static const char *const Stat_names[PINGER_STAT_COUNT] =
+	{ "uptime_ms", "requests"
+	, "ok", "cached", "timeout", "invalid", "denied", "queue_full", "busy", "error"
+	, "sent", "replies", "unmatched", "coalesced", "drops"
+	, "in_flight", "queued", "subscriptions"
+	};
+
+static void hist_sum(struct pinger_hist *s, const struct pinger_hist *h)
+{
+	unsigned i;
+	s->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	s->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	for (i = 0; i < PINGER_HIST_BUCKETS; i ++)
+		s->bucket[i] += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+}
+
+/* the largest value in the bucket holding the q quantile */
+static uint64_t hist_quantile(const struct pinger_hist *h, double q)
+{
+	uint64_t n = 0, rank = q * h->count + 0.5;
+	unsigned i;
+	if (!h->count)
+		return 0;
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < PINGER_HIST_BUCKETS - 1; i ++)
+		if ((n += h->bucket[i]) >= rank)
+			return pinger_hist_min(i + 1) - 1;
+	return pinger_hist_min(i);
+}
+
+static uint64_t socket_drops(int fd)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+	if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0
+			|| len <= SK_MEMINFO_DROPS * sizeof(*mem))
+		return 0;
+	return mem[SK_MEMINFO_DROPS];
+}
+
+static void stats_worker(struct pinger_stats *s, struct worker *w)
+{
+	unsigned i;
+	for (i = 0; i < PINGER_STAT_COUNT; i ++)
+		s->counter[i] += __atomic_load_n(&w->counter[i], __ATOMIC_RELAXED);
+	hist_sum(&s->rtt, &w->rtt);
+	hist_sum(&s->delay, &w->delay);
+	hist_sum(&s->loop, &w->loop);
+	pthread_mutex_lock(&w->lock);
+	s->counter[PINGER_STAT_IN_FLIGHT] += w->table.count;
+	pthread_mutex_unlock(&w->lock);
+	s->counter[PINGER_STAT_DROPS] += socket_drops(w->icmp);
+}
+
+/* totals over all threads, by the main thread */
+static void stats_get(struct pinger_stats *s)
+{
+	unsigned i;
+	memset(s, 0, sizeof(*s));
+	s->h = (struct pinger_hdr){ PINGER_MAGIC, PINGER_VERSION, PINGER_STATS, 1 };
+	stats_worker(s, &Main);
+	for (i = 0; i < Worker_count; i ++)
+		stats_worker(s, &Workers[i]);
+	s->counter[PINGER_STAT_UPTIME] = (clock_now() - Started) / MSEC;
+	s->counter[PINGER_STAT_QUEUED] = Active.queued;
+	s->counter[PINGER_STAT_SUBS] = Sub_count;
+}
+
+static void hist_print(FILE *f, const char *name, const struct pinger_hist *h)
+{
+	fprintf(f, "%s_count %" PRIu64 "\n%s_mean %" PRIu64 "\n", name, h->count, name, h->count ? h->sum / h->count : 0);
+	fprintf(f, "%s_p50 %" PRIu64 "\n%s_p90 %" PRIu64 "\n%s_p99 %" PRIu64
+			"\n%s_p999 %" PRIu64 "\n%s_max %" PRIu64 "\n",
+			name, hist_quantile(h, 0.5), name, hist_quantile(h, 0.9),
+			name, hist_quantile(h, 0.99), name, hist_quantile(h, 0.999),
+			name, hist_quantile(h, 1));
+}
+
+static void stats_print(FILE *f, const struct pinger_stats *s)
+{
+	unsigned i;
+	for (i = 0; i < PINGER_STAT_COUNT; i ++)
+		fprintf(f, "%s %" PRIu64 "\n", Stat_names[i], s->counter[i]);
+	hist_print(f, "rtt_us", &s->rtt);
+	hist_print(f, "delay_us", &s->delay);
+	hist_print(f, "loop_ns", &s->loop);
+}
+
+static void stats_send(const struct sockaddr_un *client, socklen_t client_len, uint32_t format)
+{
+	static struct pinger_stats s;
+	char *text;
+	size_t len;
+	FILE *f;
+	stats_get(&s);
+	if (format == PINGER_STATS_BINARY)
+		sendto(Server, &s, sizeof(s), 0, client, client_len);
+	else if (format == PINGER_STATS_TEXT && (f = open_memstream(&text, &len)))
+	{
+		stats_print(f, &s);
+		fclose(f);
+		sendto(Server, text, len, 0, client, client_len);
+		free(text);
+	}
+}
+
+static void dump_worker(const char *name, struct worker *w)
+{
+	struct table *tb = &w->table;
+	pthread_mutex_lock(&w->lock);
+	fprintf(stderr, "%s: %" PRIu64 " sent, %" PRIu64 " replies, %" PRIu64 " coalesced, %u probes (%u high)\n",
+			name, w->counter[PINGER_STAT_SENT], w->counter[PINGER_STAT_REPLIES],
+			w->counter[PINGER_STAT_COALESCED], w->probes.used, w->probes.high);
+	fprintf(stderr, "%s: in flight: %u/%u slots, probes: %.2f avg %u max\n",
+			name, tb->count, tb->bits ? 1U << tb->bits : 0,
+			tb->lookups ? (double)tb->probes / tb->lookups : 0, tb->max_probe);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void dump_stats()
+{
+	unsigned i;
+	char name[24];
+	Dump_stats = 0;
+	if (!Worker_count)
+		dump_worker("main", &Main);
+	for (i = 0; i < Worker_count; i ++)
+	{
+		snprintf(name, sizeof(name), "worker %u", i);
+		dump_worker(name, &Workers[i]);
+	}
+	pthread_mutex_lock(&Pool_lock);
+	fprintf(stderr, "pool: %u used, %u high, %u allocated, %lu exhausted\n",
+			Pool.used, Pool.high, Pool.slabs * POOL_SLAB, Pool.exhausted);
+	pthread_mutex_unlock(&Pool_lock);
+	pthread_mutex_lock(&Cache.lock);
+	fprintf(stderr, "cache: %u/%u, %lu hits, %lu misses\n",
+			Cache.count, Cache.size, Cache.hits, Cache.misses);
+	pthread_mutex_unlock(&Cache.lock);
+	fprintf(stderr, "queued: %u, rate tokens: %.1f/%u\n", Active.queued, Rate.tokens, Rate.count);
+	fprintf(stderr, "subscriptions: %u\n", Sub_count);
+	fprintf(stderr, "filters: %u accept, %u reject prefixes in %u nodes\n",
+			Filter[FILTER_ACCEPT].lpm.prefixes, Filter[FILTER_REJECT].lpm.prefixes,
+			Filter[FILTER_ACCEPT].lpm.count + Filter[FILTER_REJECT].lpm.count);
+	static struct pinger_stats s;
+	stats_get(&s);
+	stats_print(stderr, &s);
+}
+
+static void *pool_alloc(struct pool *pool)
+{
+	if (pool->max && pool->used >= pool->max)
+	{
+		pool->exhausted ++;
+		return NULL;
+	}
+	if (!pool->free)
+	{
+		char *s = aligned_alloc(64, POOL_SLAB * pool->size);
+		unsigned i;
+		if (!s)
+			die("malloc(pool): %m\n");
+		for (i = 0; i < POOL_SLAB; i ++)
+		{
+			*(void **)&s[i * pool->size] = pool->free;
+			pool->free = &s[i * pool->size];
+		}
+		pool->slabs ++;
+	}
+	void *p = pool->free;
+	pool->free = *(void **)p;
+	if (++pool->used > pool->high)
+		pool->high = pool->used;
+	memset(p, 0, pool->size);
+	return p;
+}
+
+static void pool_free(struct pool *pool, void *p)
+{
+	*(void **)p = pool->free;
+	pool->free = p;
+	pool->used --;
+}
+
+/* pingers are freed by whichever thread answers them */
+static bool pool_full()
+{
+	pthread_mutex_lock(&Pool_lock);
+	bool r = Pool.max && Pool.used >= Pool.max;
+	pthread_mutex_unlock(&Pool_lock);
+	return r;
+}
+
+static struct pinger *pinger_alloc()
+{
+	pthread_mutex_lock(&Pool_lock);
+	struct pinger *p = pool_alloc(&Pool);
+	pthread_mutex_unlock(&Pool_lock);
+	if (p)
+		p->w = &Main;
+	return p;
+}
+
+static void pinger_free(struct pinger *p)
+{
+	pthread_mutex_lock(&Pool_lock);
+	pool_free(&Pool, p);
+	pthread_mutex_unlock(&Pool_lock);
+}
+
+static void sub_free(struct sub *s)
+{
+	if (s->next)
+		s->next->prev = s->prev;
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		s->user->subs = s->next;
+	if (s->timer.idx)
+		timer_del(&Main.timers, &s->timer);
+	s->user->sub_count --;
+	Sub_count --;
+	free(s);
+}
+
+/* drop all subscriptions of a client that's gone, whoever it was */
+static void sub_drop(const struct sockaddr_un *client, socklen_t client_len)
+{
+	struct client *c;
+	struct sub *s, *n;
+	unsigned i;
+	for (i = 0; i < CLIENT_HASH; i ++)
+		for (c = Clients[i]; c; c = c->next)
+			for (s = c->subs; s; s = n)
+			{
+				n = s->next;
+				if (s->client_len == client_len && !memcmp(&s->client, client, client_len))
+				{
+					/* unless it's the one firing now, which ends after */
+					if (s->timer.idx)
+						sub_free(s);
+					else
+						s->req.count = 1;
+				}
+			}
 }
 
-static bool test_rate(const struct timeval *t)
+static void gone_add(const struct sockaddr_un *client, socklen_t client_len)
 {
-	static unsigned count;
-	static struct timeval s;
-	if (t->tv_sec - s.tv_sec > Rate_period)
+	pthread_mutex_lock(&Gone.lock);
+	/* if full, it'll fail again */
+	if (Gone.count < GONE_MAX)
 	{
-		count = 0;
-		s = *t;
+		memcpy(&Gone.client[Gone.count], client, client_len);
+		Gone.client_len[Gone.count++] = client_len;
 	}
-	return ++count <= Rate;
+	pthread_mutex_unlock(&Gone.lock);
 }
 
-static int32_t timeval_diff(const struct timeval *a, const struct timeval *b)
+static void gone_drop()
 {
-	/* assumes no wrap-around, which should be safe with timeouts limited */
-	return 1000000 * (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec);
+	unsigned i;
+	pthread_mutex_lock(&Gone.lock);
+	for (i = 0; i < Gone.count; i ++)
+		sub_drop(&Gone.client[i], Gone.client_len[i]);
+	Gone.count = 0;
+	pthread_mutex_unlock(&Gone.lock);
+}
+
+static void res_flush(struct worker *w)
+{
+	struct iovec io[PING_BATCH];
+	struct mmsghdr msg[PING_BATCH];
+	unsigned i = 0;
+	for (i = 0; i < w->result_count; i ++)
+	{
+		io[i] = (struct iovec){ &w->results[i].msg, w->results[i].len };
+		msg[i].msg_hdr = (struct msghdr)
+			{ .msg_name = &w->results[i].client
+			, .msg_namelen = w->results[i].client_len
+			, .msg_iov = &io[i]
+			, .msg_iovlen = 1
+			};
+	}
+	i = 0;
+	while (i < w->result_count)
+	{
+		int r = sendmmsg(Server, &msg[i], w->result_count-i, 0);
+		if (r > 0)
+		{
+			i += r;
+			continue;
+		}
+		/* skip over a client that can't be sent to, forgetting it if gone */
+		if (errno == ECONNREFUSED || errno == ENOENT)
+		{
+			if (w == &Main)
+				sub_drop(&w->results[i].client, w->results[i].client_len);
+			else
+				gone_add(&w->results[i].client, w->results[i].client_len);
+		}
+		i ++;
+	}
+	w->result_count = 0;
+}
+
+static enum pinger_stat result_stat(int32_t time)
+{
+	if (time >= 0)
+		return PINGER_STAT_OK;
+	switch (-time)
+	{
+		case ETIMEDOUT: return PINGER_STAT_TIMEOUT;
+		case EINVAL: return PINGER_STAT_INVALID;
+		case EACCES: return PINGER_STAT_DENIED;
+		case ENFILE: return PINGER_STAT_QUEUE_FULL;
+		case EAGAIN: return PINGER_STAT_BUSY;
+		default: return PINGER_STAT_ERROR;
+	}
 }
 
-static int pinger_send(struct pinger *p)
+static void res_add(struct worker *w, const struct sockaddr_un *client, socklen_t client_len, uint8_t version, uint32_t tag, in_addr_t host, int32_t time, uint32_t age)
 {
-	gettimeofday(&p->sent, NULL);
-	return ping_send(Icmp, p->id, p->seq, p->size, (struct in_addr){ p->req.host });
+	struct result *o = NULL;
+	unsigned i;
+	stat_inc(w, result_stat(time));
+	if (version)
+		for (i = 0; i < w->result_count; i ++)
+			if (w->results[i].version == version && w->results[i].msg.batch.h.count < PINGER_BATCH_MAX
+					&& w->results[i].client_len == client_len && !memcmp(&w->results[i].client, client, client_len))
+			{
+				o = &w->results[i];
+				break;
+			}
+	if (!o)
+	{
+		if (w->result_count == PING_BATCH)
+			res_flush(w);
+		o = &w->results[w->result_count++];
+		memcpy(&o->client, client, client_len);
+		o->client_len = client_len;
+		o->version = version;
+		if (!version)
+		{
+			o->msg.ping = (struct ping){ host, time };
+			o->len = sizeof(o->msg.ping);
+			return;
+		}
+		o->msg.batch.h = (struct pinger_hdr){ PINGER_MAGIC, version, PINGER_RESULT, 0 };
+		o->len = sizeof(o->msg.batch.h);
+	}
+	if (version == 1)
+	{
+		o->msg.batch_v1.t[o->msg.batch.h.count++] = (struct pinger_target_v1){ tag, host, time };
+		o->len += sizeof(struct pinger_target_v1);
+		return;
+	}
+	o->msg.batch.t[o->msg.batch.h.count++] = (struct pinger_target){ tag, host, time, age };
+	o->len += sizeof(struct pinger_target);
+}
+
+static void probe_free(struct worker *w, struct probe *pr)
+{
+	table_del(&w->table, pr);
+	pool_free(&w->probes, pr);
+}
+
+/* with the pinger's timer moved over to the worker */
+static void probe_attach(struct worker *w, struct probe *pr, struct pinger *p)
+{
+	if (p->w != w)
+	{
+		timer_del(&p->w->timers, &p->timer);
+		p->w = w;
+		if (timer_add(&w->timers, &p->timer) < 0)
+			die("malloc(timers): %m\n");
+	}
+	p->probe = pr;
+	p->wprev = NULL;
+	if ((p->wnext = pr->waiters))
+		p->wnext->wprev = p;
+	pr->waiters = p;
+}
+
+static void probe_detach(struct pinger *p)
+{
+	struct probe *pr = p->probe;
+	if (p->wprev)
+		p->wprev->wnext = p->wnext;
+	else
+		pr->waiters = p->wnext;
+	if (p->wnext)
+		p->wnext->wprev = p->wprev;
+	p->probe = NULL;
+	/* leave any still to be sent for send_flush() */
+	if (!pr->waiters && pr->sent)
+		probe_free(p->w, pr);
 }
 
 static void ping_res(struct pinger *p, int time)
 {
-	struct ping res = { p->req.host, time };
-	sendto(Server, &res, sizeof(res), 0, &p->client, p->client_len);
-	if (p->prev && (*p->prev = p->next))
+	res_add(p->w, &p->client, p->client_len, p->version, p->tag, p->req.host, time, 0);
+	if (p->timer.fn)
+		timer_del(&p->w->timers, &p->timer);
+	if (p->queue)
+		queue_del(p);
+	if (p->probe)
+		probe_detach(p);
+	pinger_free(p);
+}
+
+/* every request waiting on the probe gets the same result */
+static void probe_done(struct worker *w, struct probe *pr, int time)
+{
+	struct pinger *p;
+	while ((p = pr->waiters))
 	{
-		p->next->timeout += p->timeout;
-		p->next->prev = p->prev;
+		pr->waiters = p->wnext;
+		p->probe = NULL;
+		ping_res(p, time);
 	}
-	free(p);
+	probe_free(w, pr);
 }
 
-static void ping_req(const struct timeval *t)
+static void ping_expire(struct timer *t)
 {
-	struct pinger *p = calloc(sizeof(struct pinger), 1);
-	if (!p)
-		die("malloc(ping): %m\n");
-	p->client_len = sizeof(p->client);
-	ssize_t r = recvfrom(Server, &p->req, sizeof(p->req), 0, &p->client, &p->client_len);
-	if (r < 0)
-		die("server recvfrom: %m\n");
-	if (r != sizeof(p->req))
-		return free(p); /*ping_res(p, -EBADMSG)*/
+	ping_res((struct pinger *)((char *)t - offsetof(struct pinger, timer)), -ETIMEDOUT);
+}
+
+static void timer_at(struct timers *h, struct timer *tm, int64_t now, uint32_t us)
+{
+	tm->expire = now + us * USEC;
+	if (timer_add(h, tm) < 0)
+		die("malloc(timers): %m\n");
+}
+
+static void ping_timer(struct pinger *p, int64_t now)
+{
+	p->timer.fn = &ping_expire;
+	timer_at(&p->w->timers, &p->timer, now, p->timeout);
+}
+
+static void send_flush(struct worker *w)
+{
+	struct ping_pkt pkts[PING_BATCH];
+	int64_t sent;
+	unsigned i;
+
+	for (i = 0; i < w->send_count; i ++)
+	{
+		struct probe *pr = w->send_queue[i];
+		pkts[i] = (struct ping_pkt){ pr->id, pr->seq, pr->size, { pr->host }, .cookie = pr->cookie };
+	}
+	sent = clock_now();
+	ping_send_batch(w->icmp, pkts, w->send_count);
+	for (i = 0; i < w->send_count; i ++)
+	{
+		struct probe *pr = w->send_queue[i];
+		if (pkts[i].err)
+		{
+			probe_done(w, pr, -pkts[i].err);
+			continue;
+		}
+		stat_inc(w, PINGER_STAT_SENT);
+		hist_add(&w->delay, (sent - pr->requested) / USEC);
+		pr->sent = sent;
+		if (!pr->waiters)
+			probe_free(w, pr);
+	}
+	w->send_count = 0;
+}
+
+static struct worker *worker_for(in_addr_t host)
+{
+	if (!Worker_count)
+		return &Main;
+	return &Workers[(host * 0x9E3779B97F4A7C15ULL >> 32) % Worker_count];
+}
+
+/* join the probe already in flight for the host, if any */
+static bool probe_join(struct pinger *p)
+{
+	struct worker *w = worker_for(p->req.host);
+	pthread_mutex_lock(&w->lock);
+	struct probe *pr = table_host(&w->table, p->req.host);
+	if (pr)
+	{
+		probe_attach(w, pr, p);
+		stat_inc(w, PINGER_STAT_COALESCED);
+		w->kick = true;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return pr;
+}
+
+static void probe_start(struct pinger *p)
+{
+	struct worker *w = worker_for(p->req.host);
+	pthread_mutex_lock(&w->lock);
+	struct probe *pr = pool_alloc(&w->probes);
+	pr->host = p->req.host;
+	pr->size = Ping_size;
+	pr->id = w->id_bound ? w->id : htons(w->id_lo + rand() % w->id_span);
+	pr->seq = htons(w->seq++);
+	pr->cookie = ++w->cookie;
+	pr->requested = p->at;
+	table_add(&w->table, pr);
+	probe_attach(w, pr, p);
+	w->send_queue[w->send_count++] = pr;
+	if (w->send_count == PING_BATCH)
+		send_flush(w);
+	w->kick = true;
+	pthread_mutex_unlock(&w->lock);
+}
 
+static void ping_start(struct pinger *p, struct client *c, int64_t now)
+{
+	int32_t time;
+	uint32_t age;
+	p->at = now;
 	if ((p->timeout = (uint32_t)p->req.time) > MAX_PING_TIMEOUT)
 		return ping_res(p, -EINVAL);
 	if (!test_filters(p->req.host))
 		return ping_res(p, -EACCES);
-	if (!test_rate(t))
+	if (p->max_age && cache_get(p->req.host, p->max_age, now, &time, &age))
+	{
+		stat_inc(&Main, PINGER_STAT_CACHED);
+		res_add(&Main, &p->client, p->client_len, p->version, p->tag, p->req.host, time, age);
+		return pinger_free(p);
+	}
+	ping_timer(p, now);
+	if (probe_join(p))
+		return;
+	/* go straight out only when nobody is waiting */
+	if (!Active.head)
+	{
+		bucket_fill(&Rate, now);
+		bucket_fill(&c->bucket, now);
+		if (Rate.tokens >= 1 && c->bucket.tokens >= 1)
+		{
+			Rate.tokens --;
+			c->bucket.tokens --;
+			return probe_start(p);
+		}
+	}
+	if (c->queued >= Queue_max)
 		return ping_res(p, -ENFILE);
-	p->id = rand();
-	p->seq = htons(Seq++);
-	if (pinger_send(p) < 0)
-		return ping_res(p, -errno);
+	queue_push(c, p);
+}
+
+/* release queued pings as tokens allow, returning ms until more can go */
+static int queue_run(int64_t now)
+{
+	struct client *c;
+	bool progress;
+	int wait = -1;
 
-	struct pinger **pp = &Pings;
-	while ((*pp) && (*pp)->timeout < p->timeout)
+	bucket_fill(&Rate, now);
+	do {
+		struct client *end = Active.tail;
+		progress = false;
+		while (Rate.tokens >= 1 && (c = Active.head))
+		{
+			Active.head = c->active_next;
+			if (!Active.head)
+				Active.tail = NULL;
+			bucket_fill(&c->bucket, now);
+			c->deficit += DRR_QUANTUM;
+			while (c->queued && c->deficit && Rate.tokens >= 1 && c->bucket.tokens >= 1)
+			{
+				struct pinger *p = c->head;
+				queue_del(p);
+				progress = true;
+				/* free if its host has since been pinged */
+				if (probe_join(p))
+					continue;
+				Rate.tokens --;
+				c->bucket.tokens --;
+				c->deficit --;
+				probe_start(p);
+			}
+			if (c->bucket.tokens < 1)
+				c->deficit = 0;
+			if (!c->queued)
+			{
+				c->deficit = 0;
+				c->active = false;
+			}
+			else
+			{
+				c->active_next = NULL;
+				if (Active.tail)
+					Active.tail->active_next = c;
+				else
+					Active.head = c;
+				Active.tail = c;
+			}
+			if (c == end)
+				break;
+		}
+	} while (progress && Rate.tokens >= 1);
+
+	if (!Active.head)
+		return -1;
+	if (Rate.tokens < 1)
+		return bucket_wait(&Rate);
+	for (c = Active.head; c; c = c->active_next)
 	{
-		p->timeout -= (*pp)->timeout;
-		pp = &(*pp)->next;
+		int w = bucket_wait(&c->bucket);
+		if (wait < 0 || w < wait)
+			wait = w;
 	}
-	if ((p->next = *pp))
-		(*pp)->prev = &p->next;
-	p->prev = pp;
-	*pp = p;
+	return wait;
 }
 
-static void pinger_recv(const struct timeval *t)
+static void sub_fire(struct timer *tm)
 {
-	struct timeval pt = *t;
-	uint16_t id, seq;
-	struct in_addr host;
-	int r = ping_recv(Icmp, &id, &seq, &host, &pt); 
-	if (r < 0)
-		die("ping recv: %m\n");
-	if (!r)
-		return;
+	struct sub *s = (struct sub *)((char *)tm - offsetof(struct sub, timer));
+	struct pinger *p;
+	int64_t now = clock_cached();
+	stat_inc(&Main, PINGER_STAT_REQUESTS);
+	if (!(p = pinger_alloc()))
+		res_add(&Main, &s->client, s->client_len, PINGER_VERSION, s->req.tag, s->req.host, -EAGAIN, 0);
+	else
+	{
+		p->client = s->client;
+		p->client_len = s->client_len;
+		p->version = PINGER_VERSION;
+		p->tag = s->req.tag;
+		p->req = (struct ping){ s->req.host, s->req.time };
+		ping_start(p, s->user, now);
+	}
+	if (s->req.count && !--s->req.count)
+		return sub_free(s);
+	/* don't try to catch up after falling behind */
+	timer_at(&Main.timers, &s->timer, s->timer.expire < now ? now : s->timer.expire, s->req.interval);
+}
 
+static void sub_add(const struct sockaddr_un *client, socklen_t client_len, struct client *c, const struct pinger_sub *req, int64_t now)
+{
+	struct sub *s;
+	int err = 0;
+	if ((uint32_t)req->time > MAX_PING_TIMEOUT || req->interval < PINGER_MIN_INTERVAL)
+		err = -EINVAL;
+	else if (!test_filters(req->host))
+		err = -EACCES;
+	else if (c->sub_count >= Sub_user_max || Sub_count >= Sub_max)
+		err = -ENFILE;
+	else if (!(s = calloc(1, sizeof(*s))))
+		err = -ENOMEM;
+	else
+	{
+		s->timer.fn = &sub_fire;
+		s->timer.expire = now;
+		if (timer_add(&Main.timers, &s->timer) < 0)
+		{
+			free(s);
+			err = -ENOMEM;
+		}
+	}
+	if (err)
+		return res_add(&Main, client, client_len, PINGER_VERSION, req->tag, req->host, err, 0);
+	memcpy(&s->client, client, client_len);
+	s->client_len = client_len;
+	s->user = c;
+	s->req = *req;
+	if ((s->next = c->subs))
+		c->subs->prev = s;
+	c->subs = s;
+	c->sub_count ++;
+	Sub_count ++;
+}
+
+/* only the user's own can be cancelled, so there are few to look through */
+static void sub_cancel(const struct sockaddr_un *client, socklen_t client_len, struct client *c, uint32_t tag)
+{
+	struct sub *s;
+	for (s = c->subs; s; s = s->next)
+		if (s->req.tag == tag && s->client_len == client_len && !memcmp(&s->client, client, client_len))
+		{
+			res_add(&Main, client, client_len, PINGER_VERSION, tag, s->req.host, -ECANCELED, 0);
+			return sub_free(s);
+		}
+	res_add(&Main, client, client_len, PINGER_VERSION, tag, 0, -ENOENT, 0);
+}
+
+static bool batch_valid(const struct pinger_hdr *h, size_t len)
+{
+	size_t size;
+	if (len < sizeof(*h) || h->magic != PINGER_MAGIC || !h->count || h->count > PINGER_BATCH_MAX)
+		return false;
+	if (h->version == 1 && h->type == PINGER_REQUEST)
+		size = sizeof(struct pinger_target_v1);
+	else if (h->version != PINGER_VERSION)
+		return false;
+	else if (h->type == PINGER_REQUEST || h->type == PINGER_CANCEL)
+		size = sizeof(struct pinger_target);
+	else if (h->type == PINGER_STATS && h->count == 1)
+		size = sizeof(struct pinger_target);
+	else if (h->type == PINGER_SUBSCRIBE)
+		size = sizeof(struct pinger_sub);
+	else
+		return false;
+	return len == sizeof(*h) + h->count * size;
+}
+
+/* returns -1 when drained or out of pingers */
+static int ping_req_one(int64_t now)
+{
+	static union {
+		struct ping ping;
+		struct pinger_batch batch;
+		struct {
+			struct pinger_hdr h;
+			struct pinger_target_v1 t[PINGER_BATCH_MAX];
+		} batch_v1;
+		struct {
+			struct pinger_hdr h;
+			struct pinger_sub t[PINGER_BATCH_MAX];
+		} subs;
+	} msg;
+	struct sockaddr_un client;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(struct ucred))];
+	} ctl;
+	struct iovec io = { &msg, sizeof(msg) };
+	struct msghdr mh = 
+		{ .msg_name = &client
+		, .msg_namelen = sizeof(client)
+		, .msg_iov = &io
+		, .msg_iovlen = 1
+		, .msg_control = &ctl
+		, .msg_controllen = sizeof(ctl)
+		};
+	struct cmsghdr *cm;
+	uid_t uid = -1;
+	struct client *c;
 	struct pinger *p;
-	for (p = Pings; p; p = p->next)
-		if (id == p->id && seq == p->seq 
-				&& host.s_addr == p->req.host)
-			break;
+	unsigned i;
+
+	if (pool_full())
+	{
+		Pool.exhausted ++;
+		return -1;
+	}
+	ssize_t r = recvmsg(Server, &mh, 0);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+		die("server recvmsg: %m\n");
+	}
+	socklen_t client_len = mh.msg_namelen;
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_CREDENTIALS)
+			uid = ((struct ucred *)CMSG_DATA(cm))->uid;
+	c = client_get(uid, now);
+
+	if (r == sizeof(msg.ping))
+	{
+		stat_inc(&Main, PINGER_STAT_REQUESTS);
+		p = pinger_alloc();
+		p->client = client;
+		p->client_len = client_len;
+		p->req = msg.ping;
+		ping_start(p, c, now);
+		return 0;
+	}
+	if (!batch_valid(&msg.batch.h, r))
+		return 0; /*-EBADMSG*/
+	/* results can't be sent to unbound clients */
+	if (msg.batch.h.type == PINGER_SUBSCRIBE && client_len > sizeof(sa_family_t))
+	{
+		for (i = 0; i < msg.batch.h.count; i ++)
+			sub_add(&client, client_len, c, &msg.subs.t[i], now);
+		return 0;
+	}
+	if (msg.batch.h.type == PINGER_CANCEL)
+	{
+		for (i = 0; i < msg.batch.h.count; i ++)
+			sub_cancel(&client, client_len, c, msg.batch.t[i].tag);
+		return 0;
+	}
+	if (msg.batch.h.type == PINGER_STATS && client_len > sizeof(sa_family_t))
+	{
+		stats_send(&client, client_len, msg.batch.t[0].tag);
+		return 0;
+	}
+	if (msg.batch.h.type != PINGER_REQUEST)
+		return 0;
+	stat_add(&Main.counter[PINGER_STAT_REQUESTS], msg.batch.h.count);
+	for (i = 0; i < msg.batch.h.count; i ++)
+	{
+		struct pinger_target x = msg.batch.h.version == 1
+			? (struct pinger_target){ msg.batch_v1.t[i].tag, msg.batch_v1.t[i].host, msg.batch_v1.t[i].time }
+			: msg.batch.t[i];
+		if (!(p = pinger_alloc()))
+		{
+			res_add(&Main, &client, client_len, msg.batch.h.version, x.tag, x.host, -EAGAIN, 0);
+			continue;
+		}
+		p->client = client;
+		p->client_len = client_len;
+		p->version = msg.batch.h.version;
+		p->tag = x.tag;
+		p->max_age = x.age;
+		p->req = (struct ping){ x.host, x.time };
+		ping_start(p, c, now);
+	}
+	return 0;
+}
+
+static void ping_req(int64_t now)
+{
+	unsigned n = 0;
+
+	/* drain pending requests and send their pings together */
+	while (n++ < PING_BATCH && ping_req_one(now) >= 0);
+}
+
+static void pinger_reply(struct worker *w, const struct ping_pkt *r, int64_t now)
+{
+	struct probe *p = table_find(&w->table, r);
+	int32_t time;
 	if (!p)
-		return;
-	/* currently packets failing these checks are ignored above */
-	if (seq != p->seq)
+		return stat_inc(w, PINGER_STAT_UNMATCHED);
+	if (!p->sent_tx && r->rtt >= 0)
+		time = r->rtt/1000;
+	else
+		time = ((r->ts ? r->ts : now) - p->sent) / USEC;
+	stat_inc(w, PINGER_STAT_REPLIES);
+	if (time >= 0)
+		hist_add(&w->rtt, time);
+	cache_put(p->host, time, now);
+	probe_done(w, p, time);
+}
+
+static void pinger_recv(struct worker *w, int64_t now)
+{
+	struct ping_pkt replies[PING_BATCH];
+	unsigned i, n;
+	int r;
+	do {
+		n = PING_BATCH;
+		if ((r = ping_recv_batch(w->icmp, replies, &n)) < 0)
+			die("ping recv: %m\n");
+		for (i = 0; i < n; i ++)
+			pinger_reply(w, &replies[i], now);
+	} while (r == PING_BATCH);
+}
+
+static void pinger_sent(struct worker *w)
+{
+	struct ping_pkt sent[PING_BATCH];
+	unsigned i, n;
+	int r;
+	do {
+		n = PING_BATCH;
+		if ((r = ping_sent_batch(w->icmp, sent, &n)) < 0)
+			die("ping sent: %m\n");
+		for (i = 0; i < n; i ++)
+		{
+			struct probe *p = table_find(&w->table, &sent[i]);
+			if (p)
+			{
+				p->sent = sent[i].ts;
+				p->sent_tx = true;
+			}
+		}
+	} while (r == PING_BATCH);
+}
+
+/* departure times are queued before any reply can arrive */
+static void worker_icmp(struct worker *w, short revents, int64_t now)
+{
+	if (revents & POLLERR)
+		pinger_sent(w);
+	if (revents & POLLIN)
+		pinger_recv(w, now);
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct pollfd polls[2] = 
+		{ { .fd = w->icmp, .events = POLLIN }
+		, { .fd = w->wake, .events = POLLIN }
+		};
+	int64_t now;
+	uint64_t n;
+	while (1)
 	{
-		fprintf(stderr, "icmp out of order response: %hu/%hu\n", ntohs(seq), p->seq);
-		return;
+		pthread_mutex_lock(&w->lock);
+		int timeout = timer_timeout(&w->timers, clock_update());
+		pthread_mutex_unlock(&w->lock);
+		if (poll(polls, 2, timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			die("worker poll: %m\n");
+		}
+		if (polls[1].revents)
+			read(w->wake, &n, sizeof(n));
+		pthread_mutex_lock(&w->lock);
+		now = clock_update();
+		worker_icmp(w, polls[0].revents, now);
+		timer_run(&w->timers, now);
+		if (w->send_count)
+			send_flush(w);
+		if (w->result_count)
+			res_flush(w);
+		hist_add(&w->loop, clock_now() - now);
+		pthread_mutex_unlock(&w->lock);
 	}
-	if (host.s_addr != p->req.host)
-		fprintf(stderr, "icmp response from different IP: %s\n", inet_ntoa(host));
-	return ping_res(p, timeval_diff(&pt, &p->sent));
+	return NULL;
+}
+
+static void worker_kick()
+{
+	uint64_t n = 1;
+	unsigned i;
+	for (i = 0; i < Worker_count; i ++)
+		if (Workers[i].kick)
+		{
+			Workers[i].kick = false;
+			write(Workers[i].wake, &n, sizeof(n));
+		}
 }
 
 static void loop()
 {
+	static int queue_wait = -1;
+	/* leave requests queued on the socket while we're at capacity */
 	struct pollfd polls[2] = 
-		{ { .fd = Icmp, .events = POLLIN }
-		, { .fd = Server, .events = POLLIN }
+		{ { .fd = Main.icmp, .events = POLLIN }
+		, { .fd = Server, .events = pool_full() ? 0 : POLLIN }
 		};
-	int r = poll(polls, 2, Pings ? (Pings->timeout+999)/1000 : -1);
+	if (Dump_stats)
+		dump_stats();
+	if (Reload)
+	{
+		Reload = 0;
+		if (filter_load() < 0)
+			fprintf(stderr, "filters not reloaded\n");
+	}
+	int timeout = timer_timeout(&Main.timers, clock_update());
+	if (queue_wait >= 0 && (timeout < 0 || queue_wait < timeout))
+		timeout = queue_wait;
+	int r = poll(polls, 2, timeout);
 	if (r < 0)
-		die("poll: %m\n");
-	if (r == 0)
-		return ping_res(Pings, -ETIMEDOUT);
-	struct timeval t;
-	gettimeofday(&t, NULL);
-	if (Pings)
 	{
-		uint32_t td = timeval_diff(&t, &Pings->sent);
-		Pings->timeout = Pings->req.time >= td ? Pings->req.time - td : 0;
+		if (errno == EINTR)
+			return;
+		die("poll: %m\n");
 	}
-	if (polls[0].revents)
-		pinger_recv(&t);
+	int64_t now = clock_update();
+	worker_icmp(&Main, polls[0].revents, now);
 	if (polls[1].revents)
-		ping_req(&t);
+		ping_req(now);
+	/* after any replies that just made it */
+	timer_run(&Main.timers, now);
+	/* and any subscriptions just due */
+	queue_wait = queue_run(now);
+	worker_kick();
+	if (Main.send_count)
+		send_flush(&Main);
+	if (Main.result_count)
+		res_flush(&Main);
+	gone_drop();
+	hist_add(&Main.loop, clock_now() - now);
+}
+
+static void worker_open(struct worker *w, unsigned i)
+{
+	if ((w->icmp = ping_open(0)) < 0)
+		die("ping_open: %m\n");
+	/* with just the one, any id will do */
+	w->id_span = 65536 / (Worker_count ? Worker_count : 1);
+	w->id_lo = i * w->id_span;
+	if ((Worker_count ? ping_filter_range(w->icmp, w->id_lo, w->id_lo + w->id_span - 1) : ping_filter(w->icmp, NULL, 0)) < 0)
+		die("ping_filter: %m\n");
+}
+
+static void worker_bind(struct worker *w)
+{
+	w->id = rand();
+	int r = ping_bind(w->icmp, &w->id);
+	if (r < 0)
+		die("ping_bind: %m\n");
+	w->id_bound = r;
+}
+
+static void worker_start(struct worker *w)
+{
+	if ((w->wake = eventfd(0, EFD_NONBLOCK)) < 0)
+		die("eventfd: %m\n");
+	if ((errno = pthread_create(&w->thread, NULL, &worker_run, w)))
+		die("pthread_create: %m\n");
 }
 
 static const struct argp_option Options[] = 
 	{ { "socket", 'P', "PATH", 0, "listen on socket PATH for ping commands" }
 	, { "group", 'g', "NAME", 0, "allow access from group NAME" }
 	, { "rate", 'l', "COUNT/PERIOD", 0, "limit to COUNT pings per PERIOD [60/m]" }
+	, { "user-rate", 'u', "COUNT/PERIOD", 0, "limit each user to COUNT pings per PERIOD [--rate]" }
+	, { "queue", 'q', "COUNT", 0, "queue up to COUNT pings per user over the rate limit [256]" }
 	, { "accept", 'a', "IP[/MASK]", 0, "allow pings to given network [all]" }
 	, { "reject", 'r', "IP[/MASK]", 0, "reject pings to given network [none]" }
+	, { "accept-file", 'A', "FILE", 0, "allow pings to networks listed in FILE" }
+	, { "reject-file", 'R', "FILE", 0, "reject pings to networks listed in FILE" }
+	, { "max-pending", 'm', "COUNT", 0, "stop accepting requests with COUNT in progress [unlimited]" }
+	, { "subscriptions", 'S', "COUNT", 0, "allow each user up to COUNT subscriptions [64]" }
+	, { "max-subscriptions", 'M', "COUNT", 0, "allow up to COUNT subscriptions in all [4096]" }
+	, { "cache", 'C', "COUNT", 0, "remember results for up to COUNT hosts [1024]" }
+	, { "workers", 'w', "COUNT", 0, "ping from COUNT threads, each with its own socket [0: all in one]" }
+	, { "size", 's', "BYTES", 0, "send pings of BYTES, at least 60 to carry a timestamp [60]" }
 	, { }
 	};
 
+static void parse_rate(struct argp_state *state, const char *arg, struct bucket *b)
+{
+	char *p;
+	b->count = strtoul(arg, &p, 10);
+	if (!b->count || !p || *p++ != '/' || *p == '0')
+		argp_error(state, "invalid rate: %s", arg);
+	b->period = strtoul(p, &p, 10);
+	if (!b->period)
+		b->period = 1;
+	switch (*p)
+	{
+		case 'h':
+		case 'H': b->period *= 60;
+		case 'm':
+		case 'M': b->period *= 60;
+		case 's':
+		case 'S': p++;
+	}
+	if (*p)
+		argp_error(state, "unknown rate period: %s\n", p);
+	b->tokens = b->count;
+}
+
 static error_t parse_opt(int key, char *optarg, struct argp_state *state)
 {
 	char *p;
 	enum filter_type ft;
+	struct netmask nm;
 	switch (key) {
 		case 'P':
 			strncpy(Server_addr.sun_path, optarg, sizeof(Server_addr.sun_path)-1);
@@ -255,36 +1672,69 @@ static error_t parse_opt(int key, char *optarg, struct argp_state *state)
 			return 0;
 
 		case 'l':
-			p = optarg;
-			Rate = strtoul(p, &p, 10);
-			if (!Rate || !p || *p++ != '/' || *p == '0')
-				argp_error(state, "invalid rate: %s", optarg);
-			Rate_period = strtoul(p, &p, 10);
-			if (!Rate_period)
-				Rate_period = 1;
-			switch (*p)
-			{
-				case 'h':
-				case 'H': Rate_period *= 60;
-				case 'm':
-				case 'M': Rate_period *= 60;
-				case 's':
-				case 'S': p++;
-			}
+			parse_rate(state, optarg, &Rate);
+			return 0;
+
+		case 'u':
+			parse_rate(state, optarg, &Client_rate);
+			return 0;
+
+		case 'q':
+			Queue_max = strtoul(optarg, &p, 10);
+			if (*p)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 'm':
+			Pool.max = strtoul(optarg, &p, 10);
+			if (*p)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 'S':
+			Sub_user_max = strtoul(optarg, &p, 10);
+			if (*p)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 'M':
+			Sub_max = strtoul(optarg, &p, 10);
+			if (*p)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 'C':
+			Cache.size = strtoul(optarg, &p, 10);
 			if (*p)
-				argp_error(state, "unknown rate period: %s\n", p);
+				argp_error(state, "invalid count: %s", optarg);
 			return 0;
 
+		case 'w':
+			Worker_count = strtoul(optarg, &p, 10);
+			if (*p || Worker_count > WORKER_MAX)
+				argp_error(state, "invalid count: %s", optarg);
+			return 0;
+
+		case 's': {
+			unsigned long n = strtoul(optarg, &p, 10);
+			if (*p || n < PING_MIN_SIZE || n > PING_MAX_SIZE)
+				argp_error(state, "invalid size: %s", optarg);
+			Ping_size = n;
+			return 0;
+		}
+
 		case 'a':
+		case 'A':
 			ft = FILTER_ACCEPT;
 			if (0)
 		case 'r':
+		case 'R':
 			ft = FILTER_REJECT;
-			if (Filter[ft].count == MAX_FILTERS)
-				argp_error(state, "too many filters specified\n");
-			if (parse_netmask(&Filter[ft].filters[Filter[ft].count], optarg) < 0)
+			if (islower(key) && parse_netmask(&nm, optarg) < 0)
 				argp_error(state, "invalid network: %s\n", optarg);
-			Filter[ft].count ++;
+			if (!(Filter[ft].src = realloc(Filter[ft].src, (Filter[ft].count + 1) * sizeof(*Filter[ft].src))))
+				argp_failure(state, 1, errno, "malloc(filter)");
+			Filter[ft].src[Filter[ft].count++] = (struct filter_source){ optarg, isupper(key) };
 			return 0;
 
 		default:
@@ -299,18 +1749,54 @@ static const struct argp Argp = {
 
 int main(int argc, char **argv)
 {
-	if ((Icmp = ping_open()) < 0)
-		die("ping_open: %m\n");
+	unsigned i;
+	uid_t euid = geteuid();
+	Started = clock_now();
+	/* the number of sockets to open depends on the options, so parse them
+	 * as the user, only taking privileges back to open the sockets */
+	if (seteuid(getuid()))
+		die("seteuid: %m\n");
+	if ((errno = argp_parse(&Argp, argc, argv, 0, 0, 0)))
+		die("argp_parse: %m\n");
+	if (Worker_count && !(Workers = calloc(Worker_count, sizeof(*Workers))))
+		die("malloc(workers): %m\n");
+	if (seteuid(euid))
+		die("seteuid: %m\n");
+	for (i = 0; i < Worker_count; i ++)
+	{
+		pthread_mutex_init(&Workers[i].lock, NULL);
+		Workers[i].probes.size = sizeof(struct probe);
+		worker_open(&Workers[i], i);
+	}
+	if (!Worker_count)
+		worker_open(&Main, 0);
 
 	if (setuid(getuid()))
 		die("setuid: %m\n");
 
 	srand(getpid() ^ (time(NULL) << 16));
-	if ((errno = argp_parse(&Argp, argc, argv, 0, 0, 0)))
-		die("argp_parse: %m\n");
+	for (i = 0; i < Worker_count; i ++)
+		worker_bind(&Workers[i]);
+	if (!Worker_count)
+		worker_bind(&Main);
+	if (filter_load() < 0)
+		die("invalid filters\n");
 
+	/* signals are left to the main thread */
+	sigset_t mask, omask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	for (i = 0; i < Worker_count; i ++)
+		worker_start(&Workers[i]);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
 	if (signal(SIGTERM, &stop) == SIG_ERR ||
-			signal(SIGINT, &stop) == SIG_ERR)
+			signal(SIGINT, &stop) == SIG_ERR ||
+			signal(SIGUSR1, &stats) == SIG_ERR ||
+			signal(SIGHUP, &reload) == SIG_ERR)
 		die("signal: %m\n");
 	open_server();
 
@@ -1,5 +1,4 @@
 #include <arpa/inet.h>
-#include <sys/time.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -9,6 +8,7 @@
 #include <argp.h>
 #include <math.h>
 #include <time.h>
+#include "clock.h"
 
 static const struct argp_option Options[] = 
 	{ { "interval",		'i', "SEC", 0,		"interval/timeout between pings [60]" }
@@ -176,38 +176,41 @@ int main(int argc, char **argv)
 	if (sigprocmask(SIG_UNBLOCK, &sigset, NULL))
 		die("sigunblock: %m\n");
 
-	struct timeval last = {};
+	/* pings go out on multiples of Interval by the wall clock, but are
+	 * timed by the monotonic one, so setting it doesn't upset the deltas */
+	int64_t last = 0;
+	struct timespec last_wall = {};
 	while (1)
 	{
-		struct timeval curr, next = { Interval * (1 + last.tv_sec / Interval) };
-		if (gettimeofday(&curr, NULL) < 0)
-			die("gettimeofday: %m\n");
-		if (timercmp(&curr, &next, <))
+		int64_t curr = clock_now();
+		struct timespec wall;
+		if (last)
 		{
-			struct timespec diff;
-			timersub(&next, &curr, &curr);
-			TIMEVAL_TO_TIMESPEC(&curr, &diff);
-			if (nanosleep(&diff, NULL) < 0)
-				die("nanosleep: %m\n");
-			if (gettimeofday(&curr, NULL) < 0)
-				die("gettimeofday: %m\n");
+			int64_t next = last + ((int64_t)Interval * (1 + last_wall.tv_sec / Interval) - last_wall.tv_sec) * NSEC - last_wall.tv_nsec;
+			if (curr < next)
+			{
+				struct timespec ts = { next / NSEC, next % NSEC };
+				if ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)))
+					die("clock_nanosleep: %m\n");
+				curr = clock_now();
+			}
 		}
+		clock_to_real(curr, &wall);
 
 		if (ping_send(Ping) < 0)
 			die("ping_send: %s\n", ping_get_error(Ping));
 
 
-		struct timeval diff;
-		timersub(&curr, &last, &diff);
+		int64_t diff = curr - last;
 		delta_t dtime;
-		if (!timerisset(&last) || diff.tv_sec >= DELTA_THRESH)
+		if (!last || diff >= DELTA_THRESH * NSEC)
 		{
 			/* 2038 bug */
-			write_val(curr.tv_sec & ~DELTA_BIT, "time");
-			dtime = curr.tv_usec;
+			write_val(wall.tv_sec & ~DELTA_BIT, "time");
+			dtime = wall.tv_nsec / USEC;
 		}
 		else
-			dtime = DELTA_BIT | (DELTA_UNITS*diff.tv_sec + diff.tv_usec);
+			dtime = DELTA_BIT | diff / (NSEC / DELTA_UNITS);
 
 		if (sigprocmask(SIG_BLOCK, &sigset, NULL))
 			die("sigblock: %m\n");
@@ -283,6 +286,7 @@ int main(int argc, char **argv)
 			}
 		}
 
-		memcpy(&last, &curr, sizeof(struct timeval));
+		last = curr;
+		last_wall = wall;
 	}
 }
@@ -24,9 +24,12 @@ int main(int argc, char **argv) {
 	if (argc != 2 || !inet_aton(argv[1], &a))
 		DIE("Usage: %s IP\n", argv[0]);
 
-	int p = ping_open();
+	/* sizes are told apart by id, so this needs a raw socket */
+	int p = ping_open(SOCK_RAW);
 	if (p < 0)
 		DIE("ping_open: %m\n");
+	if (ping_filter(p, NULL, 0) < 0)
+		DIE("ping_filter: %m\n");
 
 	if (setuid(getuid()))
 		DIE("setuit: %m\n");
@@ -45,13 +48,22 @@ int main(int argc, char **argv) {
 	uint16_t base = rand();
 	unsigned total = 0;
 	while (!Stop) {
-		unsigned l = rand() % RANGE;
-		uint16_t id = -1;
-		if (ping_send(p, base+l, ++sent[l], PING_MIN_SIZE+l, a))
-			DIE("ping_send: %m\n");
-		// printf("send     %u %u\n", l, sent[l]);
-		fprintf(stderr, "\r%u", ++total);
-		do {
+		struct ping_pkt batch[PING_BATCH];
+		unsigned i, n;
+		for (i = 0; i < PING_BATCH; i ++) {
+			unsigned l = rand() % RANGE;
+			batch[i] = (struct ping_pkt){ base+l, ++sent[l], PING_MIN_SIZE+l, a };
+		}
+		n = ping_send_batch(p, batch, PING_BATCH);
+		for (i = 0; i < PING_BATCH; i ++)
+			if (batch[i].err) {
+				errno = batch[i].err;
+				DIE("ping_send: %m\n");
+			}
+		// printf("send     %u\n", n);
+		total += n;
+		fprintf(stderr, "\r%u", total);
+		while (n) {
 			int r = poll(polls, 1, 100);
 			if (r < 0) {
 				if (errno == EINTR)
@@ -60,7 +72,15 @@ int main(int argc, char **argv) {
 			}
 			if (!r)
 				break;
-			uint16_t seq;
+			if (polls[0].revents & POLLERR) {
+				/* transmit timestamps, not needed here */
+				struct ping_pkt ts[PING_BATCH];
+				unsigned m = PING_BATCH;
+				if (ping_sent_batch(p, ts, &m) < 0)
+					DIE("ping_sent: %m\n");
+				continue;
+			}
+			uint16_t id, seq;
 			struct in_addr h;
 			r = ping_recv(p, &id, &seq, &h, NULL);
 			if (r < 0)
@@ -68,14 +88,15 @@ int main(int argc, char **argv) {
 			if (!r)
 				continue;
 			id -= base;
-			if (memcmp(&a, &h, sizeof(struct in_addr)) || id >= RANGE || seq != (uint16_t)sent[id] || seq <= last[id]) {
+			if (memcmp(&a, &h, sizeof(struct in_addr)) || id >= RANGE || seq > (uint16_t)sent[id] || seq <= last[id]) {
 				fprintf(stderr, "bogey: %s %u %u\n", inet_ntoa(h), id, seq);
 				continue;
 			}
-			// printf("recv %s %u %u\n", id == l ? "   " : "ooo", id, seq);
+			// printf("recv %u %u\n", id, seq);
 			recvd[id] ++;
 			last[id] = seq;
-		} while (id != l);
+			n --;
+		}
 	}
 
 	for (unsigned l = 0; l < RANGE; l ++)
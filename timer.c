@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include "timer.h"
+
+#define ARITY 4
+
+static inline void heap_set(struct timers *h, unsigned i, struct timer *t)
+{
+	h->heap[i] = t;
+	t->idx = i + 1;
+}
+
+static void sift_up(struct timers *h, unsigned i, struct timer *t)
+{
+	while (i)
+	{
+		unsigned p = (i - 1) / ARITY;
+		if (t->expire >= h->heap[p]->expire)
+			break;
+		heap_set(h, i, h->heap[p]);
+		i = p;
+	}
+	heap_set(h, i, t);
+}
+
+static void sift_down(struct timers *h, unsigned i, struct timer *t)
+{
+	while (1)
+	{
+		unsigned c = ARITY*i + 1, m = c, e = c + ARITY;
+		if (c >= h->count)
+			break;
+		if (e > h->count)
+			e = h->count;
+		for (c ++; c < e; c ++)
+			if (h->heap[c]->expire < h->heap[m]->expire)
+				m = c;
+		if (h->heap[m]->expire >= t->expire)
+			break;
+		heap_set(h, i, h->heap[m]);
+		i = m;
+	}
+	heap_set(h, i, t);
+}
+
+int timer_add(struct timers *h, struct timer *t)
+{
+	if (t->idx)
+	{
+		unsigned i = t->idx - 1;
+		if (i && t->expire < h->heap[(i - 1) / ARITY]->expire)
+			sift_up(h, i, t);
+		else
+			sift_down(h, i, t);
+		return 0;
+	}
+	if (h->count == h->size)
+	{
+		unsigned size = h->size ? 2*h->size : 64;
+		struct timer **heap = realloc(h->heap, size * sizeof(*heap));
+		if (!heap)
+			return -1;
+		h->heap = heap;
+		h->size = size;
+	}
+	sift_up(h, h->count++, t);
+	return 0;
+}
+
+void timer_del(struct timers *h, struct timer *t)
+{
+	if (!t->idx)
+		return;
+	unsigned i = t->idx - 1;
+	struct timer *l = h->heap[--h->count];
+	t->idx = 0;
+	if (l == t)
+		return;
+	if (i && l->expire < h->heap[(i - 1) / ARITY]->expire)
+		sift_up(h, i, l);
+	else
+		sift_down(h, i, l);
+}
+
+unsigned timer_run(struct timers *h, int64_t now)
+{
+	unsigned n = 0;
+	struct timer *t;
+	while (h->count && (t = h->heap[0])->expire <= now)
+	{
+		timer_del(h, t);
+		t->fn(t);
+		n ++;
+	}
+	return n;
+}
+
+int timer_timeout(const struct timers *h, int64_t now)
+{
+	if (!h->count)
+		return -1;
+	return clock_timeout(h->heap[0]->expire, now);
+}
@@ -0,0 +1,26 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "clock.h"
+
+struct timer {
+	int64_t expire; /* CLOCK_MONOTONIC ns */
+	void (*fn)(struct timer *);
+	unsigned idx; /* heap position + 1, 0 if not pending */
+};
+
+/* 4-ary min-heap of pending timers */
+struct timers {
+	struct timer **heap;
+	unsigned count, size;
+};
+
+/* schedules t at t->expire, or reschedules it if already pending */
+int timer_add(struct timers *, struct timer *t);
+void timer_del(struct timers *, struct timer *t);
+/* calls every timer expired by now, each already removed; returns the count */
+unsigned timer_run(struct timers *, int64_t now);
+/* poll timeout in ms until the next timer, or -1 if none */
+int timer_timeout(const struct timers *, int64_t now);
+
+#endif
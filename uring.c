@@ -0,0 +1,148 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "uring.h"
+
+int uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	int err;
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	/* for timeouts without a timeout request */
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+	{
+		errno = ENOSYS;
+		goto fail;
+	}
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && u->cq_ring_size > u->sq_ring_size)
+		u->sq_ring_size = u->cq_ring_size;
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else if ((u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		u->cq_ring = NULL;
+		goto fail;
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(*u->sqes), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+	{
+		u->sqes = NULL;
+		goto fail;
+	}
+	u->sq_entries = p.sq_entries;
+	u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+	return 0;
+fail:
+	err = errno;
+	uring_exit(u);
+	errno = err;
+	return -1;
+}
+
+void uring_exit(struct uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sq_entries * sizeof(*u->sqes));
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	u->sqes = NULL;
+	u->sq_ring = u->cq_ring = NULL;
+	u->fd = -1;
+}
+
+static int uring_enter(struct uring *u, unsigned wait, int timeout)
+{
+	struct __kernel_timespec ts = { timeout / 1000, timeout % 1000 * 1000000 };
+	struct io_uring_getevents_arg arg = { .ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+	if (!wait && !u->queued)
+		return 0;
+	int r = syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+			(wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (r < 0)
+		return errno == ETIME ? 0 : -1;
+	u->queued -= r;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries
+			&& (uring_enter(u, 0, 0) < 0 || tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries))
+		return NULL;
+	struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued ++;
+	return sqe;
+}
+
+int uring_poll(struct uring *u, int fd, unsigned events, bool multi, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = data;
+	return 0;
+}
+
+int uring_read(struct uring *u, int fd, void *buf, unsigned len, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = -1; /* the file position, as read() */
+	sqe->user_data = data;
+	return 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+void uring_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_wait(struct uring *u, int timeout)
+{
+	/* only submit if there's something already waiting */
+	return uring_enter(u, uring_peek(u) ? 0 : 1, timeout);
+}
@@ -0,0 +1,37 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+
+/* just enough io_uring, through the raw syscalls, for event loops: requests
+ * are queued and submitted together by the next uring_wait() */
+struct uring {
+	int fd; /* -1 if not in use */
+	unsigned sq_entries, sq_mask, cq_mask;
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned *cq_head, *cq_tail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned queued;
+};
+
+/* returns -1 with errno set if io_uring, or a feature needed, is missing */
+int uring_init(struct uring *, unsigned entries);
+void uring_exit(struct uring *);
+/* each completion carries the request's data; multishot polls, from Linux
+ * 5.13, stay armed while their completions have IORING_CQE_F_MORE */
+int uring_poll(struct uring *, int fd, unsigned events, bool multi, uint64_t data);
+int uring_read(struct uring *, int fd, void *buf, unsigned len, uint64_t data);
+/* submits the requests queued and waits up to timeout ms, or indefinitely
+ * if negative, for a completion; -1 with errno EINTR if interrupted */
+int uring_wait(struct uring *, int timeout);
+/* the next completion, if any, until uring_seen() */
+struct io_uring_cqe *uring_peek(struct uring *);
+void uring_seen(struct uring *);
+
+#endif